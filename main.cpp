@@ -1,28 +1,59 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <cassert>
+#include <cerrno>
+#include <cinttypes>
+#include <cmath>
 #include <csignal>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <functional>
+#include <limits>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <optional>
-#include <semaphore>
+#include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 #include <wayland-server-core.h>
+#include <xkbcommon/xkbcommon.h>
 
 extern "C" {
 #include <spawn.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 #include <wait.h>
 }
 
 extern "C" {
+#include <drm_fourcc.h>
 #include <wlr/backend.h>
+#include <wlr/backend/headless.h>
 #include <wlr/render/allocator.h>
 #include <wlr/render/wlr_renderer.h>
+#include <wlr/types/wlr_buffer.h>
 #include <wlr/types/wlr_compositor.h>
+#include <wlr/types/wlr_content_type_v1.h>
 #include <wlr/types/wlr_cursor.h>
 #include <wlr/types/wlr_data_device.h>
+#include <wlr/types/wlr_idle_inhibit_v1.h>
+#include <wlr/types/wlr_idle_notify_v1.h>
+#include <wlr/types/wlr_linux_dmabuf_v1.h>
 #include <wlr/types/wlr_output_layout.h>
+#include <wlr/types/wlr_output_management_v1.h>
+#include <wlr/types/wlr_presentation_time.h>
+#include <wlr/types/wlr_relative_pointer_v1.h>
 #include <wlr/types/wlr_scene.h>
 #include <wlr/types/wlr_subcompositor.h>
+#include <wlr/types/wlr_tearing_control_v1.h>
 #include <wlr/types/wlr_xcursor_manager.h>
 #include <wlr/types/wlr_xdg_shell.h>
 #include <wlr/util/log.h>
@@ -77,8 +108,21 @@ private:
   T *m_ptr = nullptr;
 };
 
+class backend;
 class renderer;
 
+// Sources are created by the various wl_event_loop_add_* functions.
+class event_source : public w_ptr_wrapper_base<event_source, wl_event_source> {
+public:
+  using base::base;
+  using destroy_fn =
+      decltype([](wl_event_source *ptr) { wl_event_source_remove(ptr); });
+
+  void timer_update(int ms_delay) {
+    wl_event_source_timer_update(get(), ms_delay);
+  }
+};
+
 class display : public w_ptr_wrapper_base<display, wl_display> {
 public:
   using base::base;
@@ -89,6 +133,12 @@ public:
 
   void terminate() { wl_display_terminate(get()); }
 
+  // run() does this on every iteration; callers dispatching the loop by
+  // hand have to do it themselves
+  void flush_clients() { wl_display_flush_clients(get()); }
+
+  auto *get_event_loop() { return wl_display_get_event_loop(get()); }
+
   const char *add_socket_auto() { return wl_display_add_socket_auto(get()); }
 
   auto *init_xdg_shell(uint32_t version) {
@@ -104,6 +154,10 @@ public:
 
   auto *init_compositor(uint32_t version, renderer &renderer);
 
+  auto *init_presentation(backend &backend);
+
+  auto *init_linux_dmabuf(uint32_t version, renderer &renderer);
+
   auto *init_subcompositor() {
     if (m_subcompositor == nullptr)
       m_subcompositor = wlr_subcompositor_create(get());
@@ -116,24 +170,76 @@ public:
     return m_data_device_manager;
   }
 
+  auto *init_content_type_manager(uint32_t version) {
+    if (m_content_type_manager == nullptr)
+      m_content_type_manager =
+          wlr_content_type_manager_v1_create(get(), version);
+    return m_content_type_manager;
+  }
+
+  auto *init_tearing_control_manager(uint32_t version) {
+    if (m_tearing_control_manager == nullptr)
+      m_tearing_control_manager =
+          wlr_tearing_control_manager_v1_create(get(), version);
+    return m_tearing_control_manager;
+  }
+
+  auto *init_output_manager() {
+    if (m_output_manager == nullptr)
+      m_output_manager = wlr_output_manager_v1_create(get());
+    return m_output_manager;
+  }
+
+  auto *init_idle_notifier() {
+    if (m_idle_notifier == nullptr)
+      m_idle_notifier = wlr_idle_notifier_v1_create(get());
+    return m_idle_notifier;
+  }
+
+  auto *init_idle_inhibit_manager() {
+    if (m_idle_inhibit_manager == nullptr)
+      m_idle_inhibit_manager = wlr_idle_inhibit_v1_create(get());
+    return m_idle_inhibit_manager;
+  }
+
+  auto *init_relative_pointer_manager() {
+    if (m_relative_pointer_manager == nullptr)
+      m_relative_pointer_manager =
+          wlr_relative_pointer_manager_v1_create(get());
+    return m_relative_pointer_manager;
+  }
+
 private:
   // will be destroyed by the display
   wlr_xdg_shell *m_xdg_shell = nullptr;
   wlr_compositor *m_compositor = nullptr;
   wlr_subcompositor *m_subcompositor = nullptr;
   wlr_data_device_manager *m_data_device_manager = nullptr;
+  wlr_presentation *m_presentation = nullptr;
+  wlr_linux_dmabuf_v1 *m_linux_dmabuf = nullptr;
+  wlr_relative_pointer_manager_v1 *m_relative_pointer_manager = nullptr;
+  wlr_idle_notifier_v1 *m_idle_notifier = nullptr;
+  wlr_content_type_manager_v1 *m_content_type_manager = nullptr;
+  wlr_idle_inhibit_manager_v1 *m_idle_inhibit_manager = nullptr;
+  wlr_tearing_control_manager_v1 *m_tearing_control_manager = nullptr;
+  wlr_output_manager_v1 *m_output_manager = nullptr;
 };
 
 class backend : public w_ptr_wrapper_base<backend, wlr_backend> {
 public:
   using base::base;
-  using create_fn = decltype([](display &d) {
-    return wlr_backend_autocreate(d.get(), nullptr);
+  using create_fn = decltype([](display &d, bool headless) {
+    return headless ? wlr_headless_backend_create(d.get_event_loop())
+                    : wlr_backend_autocreate(d.get_event_loop(), nullptr);
   });
   using destroy_fn =
       decltype([](wlr_backend *ptr) { wlr_backend_destroy(ptr); });
 
   bool start() { return wlr_backend_start(get()); }
+
+  auto *add_headless_output(unsigned int width, unsigned int height) {
+    return wlr_headless_add_output(get(), width, height);
+  }
 };
 
 class renderer : public w_ptr_wrapper_base<renderer, wlr_renderer> {
@@ -144,8 +250,12 @@ public:
   using destroy_fn =
       decltype([](wlr_renderer *ptr) { wlr_renderer_destroy(ptr); });
 
-  void init_wl_display(display &d) {
-    wlr_renderer_init_wl_display(get(), d.get());
+  // linux-dmabuf is created separately so the scene can send feedback
+  void init_wl_shm(display &d) { wlr_renderer_init_wl_shm(get(), d.get()); }
+
+  bool supports_dmabuf() {
+    return wlr_renderer_get_texture_formats(get(), WLR_BUFFER_CAP_DMABUF) !=
+           nullptr;
   }
 };
 
@@ -155,6 +265,19 @@ auto *display::init_compositor(uint32_t version, renderer &renderer) {
   return m_compositor;
 }
 
+auto *display::init_presentation(backend &backend) {
+  if (m_presentation == nullptr)
+    m_presentation = wlr_presentation_create(get(), backend.get());
+  return m_presentation;
+}
+
+auto *display::init_linux_dmabuf(uint32_t version, renderer &renderer) {
+  if (m_linux_dmabuf == nullptr && renderer.supports_dmabuf())
+    m_linux_dmabuf = wlr_linux_dmabuf_v1_create_with_renderer(
+        get(), version, renderer.get());
+  return m_linux_dmabuf;
+}
+
 class allocator : public w_ptr_wrapper_base<allocator, wlr_allocator> {
 public:
   using base::base;
@@ -169,7 +292,9 @@ class output_layout
     : public w_ptr_wrapper_base<output_layout, wlr_output_layout> {
 public:
   using base::base;
-  using create_fn = decltype([]() { return wlr_output_layout_create(); });
+  using create_fn = decltype([](display &d) {
+    return wlr_output_layout_create(d.get());
+  });
   using destroy_fn =
       decltype([](wlr_output_layout *ptr) { wlr_output_layout_destroy(ptr); });
 };
@@ -191,25 +316,102 @@ public:
     wlr_cursor_attach_input_device(get(), device);
   }
 
+  // looking up and uploading the theme image only happens when it or the
+  // manager changes; without a manager the image waits for one
   void set_xcursor(wlr_xcursor_manager *manager, const char *name) {
-    wlr_cursor_set_xcursor(get(), manager, name);
+    if (m_xcursor_manager == manager && m_xcursor_name == name)
+      return;
+    if (manager != nullptr)
+      wlr_cursor_set_xcursor(get(), manager, name);
+    m_xcursor_manager = manager;
+    m_xcursor_name = name;
+  }
+
+  // shows the current theme image from another manager
+  void set_xcursor_manager(wlr_xcursor_manager *manager) {
+    if (m_xcursor_name.empty())
+      return;
+    auto name = m_xcursor_name;
+    set_xcursor(manager, name.c_str());
   }
 
   void set_surface(wlr_surface *surface = nullptr, int32_t hotspot_x = 0,
                    int32_t hotspot_y = 0) {
     wlr_cursor_set_surface(get(), surface, hotspot_x, hotspot_y);
+    m_xcursor_manager = nullptr;
+    m_xcursor_name.clear();
   }
+
+private:
+  // both empty while a client provided image is shown
+  wlr_xcursor_manager *m_xcursor_manager = nullptr;
+  std::string m_xcursor_name;
 };
 
 class scene : public w_ptr_wrapper_base<scene, wlr_scene> {
 public:
   using base::base;
   using create_fn = decltype([]() { return wlr_scene_create(); });
-  using destroy_fn = default_free<wlr_scene>;
+  // the root tree owns the scene; destroying it also removes the scene's
+  // listener on the linux-dmabuf global, which outlives it
+  using destroy_fn = decltype([](wlr_scene *ptr) {
+    wlr_scene_node_destroy(&ptr->tree.node);
+  });
 
   decltype(auto) attach_output_layout(output_layout &layout) {
     return wlr_scene_attach_output_layout(get(), layout.get());
   }
+
+  // per-output scanout tranches are sent to surfaces that could be
+  // scanned out, the renderer's formats to everything else
+  void set_linux_dmabuf(wlr_linux_dmabuf_v1 *linux_dmabuf) {
+    if (linux_dmabuf != nullptr)
+      wlr_scene_set_linux_dmabuf_v1(get(), linux_dmabuf);
+  }
+
+  wlr_surface *surface_at(double lx, double ly, double &sx, double &sy) {
+    auto *node = wlr_scene_node_at(&get()->tree.node, lx, ly, &sx, &sy);
+    if (node == nullptr || node->type != WLR_SCENE_NODE_BUFFER)
+      return nullptr;
+    auto *scene_surface =
+        wlr_scene_surface_try_from_buffer(wlr_scene_buffer_from_node(node));
+    return scene_surface != nullptr ? scene_surface->surface : nullptr;
+  }
+
+  // outputs only send frame-done to buffers they are the primary output
+  // of, so occluded, off-screen and disabled buffers never hear back from
+  // them; this calls f for those whose surface waits for a frame callback
+  template <typename F> void for_each_hidden_waiter(F &&f) {
+    for_each_buffer(&get()->tree.node, true,
+                    [&f](wlr_scene_buffer *buffer, bool visible) {
+                      if (visible && buffer->primary_output != nullptr)
+                        return;
+                      auto *scene_surface =
+                          wlr_scene_surface_try_from_buffer(buffer);
+                      if (scene_surface != nullptr &&
+                          wl_list_empty(&scene_surface->surface->current
+                                             .frame_callback_list) == 0)
+                        f(buffer);
+                    });
+  }
+
+private:
+  // unlike wlr_scene_node_for_each_buffer this also enters disabled trees,
+  // where a spare client lives
+  template <typename F>
+  static void for_each_buffer(wlr_scene_node *node, bool visible, F &&f) {
+    visible = visible && node->enabled;
+    if (node->type == WLR_SCENE_NODE_BUFFER) {
+      f(wlr_scene_buffer_from_node(node), visible);
+      return;
+    }
+    if (node->type != WLR_SCENE_NODE_TREE)
+      return;
+    wlr_scene_node *child = nullptr;
+    wl_list_for_each(child, &wlr_scene_tree_from_node(node)->children, link) {
+      for_each_buffer(child, visible, f);
+    }
+  }
 };
 
 class seat : public w_ptr_wrapper_base<seat, wlr_seat> {
@@ -220,61 +422,597 @@ public:
   });
   using destroy_fn = decltype([](wlr_seat *ptr) { wlr_seat_destroy(ptr); });
 
+  void add_capabilities(uint32_t caps) {
+    wlr_seat_set_capabilities(get(), get()->capabilities | caps);
+  }
+
   void pointer_notify_frame() { wlr_seat_pointer_notify_frame(get()); }
 
+  void pointer_notify_enter(wlr_surface *surface, double sx, double sy) {
+    wlr_seat_pointer_notify_enter(get(), surface, sx, sy);
+  }
+
+  void pointer_notify_motion(uint32_t time_msec, double sx, double sy) {
+    wlr_seat_pointer_notify_motion(get(), time_msec, sx, sy);
+  }
+
+  void pointer_clear_focus() { wlr_seat_pointer_clear_focus(get()); }
+
   void set_keyboard(wlr_keyboard *kbd) { wlr_seat_set_keyboard(get(), kbd); }
 };
 
-class xcursor_manager
-    : public w_ptr_wrapper_base<xcursor_manager, wlr_xcursor_manager> {
-public:
-  using base::base;
-  using create_fn = decltype([](const char *name, uint32_t size) {
-    return wlr_xcursor_manager_create(name, size);
-  });
-  using destroy_fn = decltype([](wlr_xcursor_manager *ptr) {
-    wlr_xcursor_manager_destroy(ptr);
-  });
+namespace detail {
+template <typename T> struct member_pointer_traits;
+
+template <typename Struct, typename Member>
+struct member_pointer_traits<Member Struct::*> {
+  using owner = Struct;
+  using member = Member;
 };
 
-namespace detail {
-template <typename Struct, typename Data = void> struct listener_base {
+// A member pointer cannot be turned into an offset in a constant expression,
+// so the offset is measured on the first object connected; every object of
+// the owning type shares it.
+template <auto Member> inline std::ptrdiff_t member_offset = 0;
+
+// Converts the signal's void * to whatever the handler takes.
+struct signal_data {
+  void *ptr;
+  template <typename T> operator T *() const { return static_cast<T *>(ptr); }
+};
+
+// A bare wl_listener whose handler is part of its type. connect() recovers
+// the owning object from the member offset, so no back pointer is stored and
+// dispatch costs one load more than a hand written wl_container_of.
+template <auto Handler> class listener {
 public:
-  listener_base(const listener_base &) = delete;
-  listener_base(listener_base &&) = delete;
-  listener_base &operator=(const listener_base &) = delete;
-  listener_base &operator=(listener_base &&) = delete;
+  static constexpr auto handler = Handler;
 
-  template <typename F>
-  listener_base(Struct *self, F)
-      : m_listener{.notify = [](wl_listener *listener, void *data) -> void {
-          // NOLINTBEGIN
-          auto *pl = reinterpret_cast<listener_base *>(
-              reinterpret_cast<char *>(listener) -
-              offsetof(listener_base, m_listener));
-          // NOLINTEND
-          std::invoke(F{}, pl->m_self_ptr, static_cast<Data *>(data));
-        }},
-        m_self_ptr(self) {}
-
-  ~listener_base() { wl_list_remove(&m_listener.link); }
+  // so that a listener which was never added can still be removed
+  listener() { wl_list_init(&m_listener.link); }
+  listener(const listener &) = delete;
+  listener(listener &&) = delete;
+  listener &operator=(const listener &) = delete;
+  listener &operator=(listener &&) = delete;
+
+  ~listener() { wl_list_remove(&m_listener.link); }
 
   constexpr wl_listener *get() { return std::addressof(m_listener); }
 
-  constexpr void add_to_signal(wl_signal &signal) {
-    wl_signal_add(&signal, get());
+  void remove() {
+    wl_list_remove(&m_listener.link);
+    wl_list_init(&m_listener.link);
   }
 
 private:
-  wl_listener m_listener; // mutable ?
-  Struct *m_self_ptr;
+  wl_listener m_listener{};
 };
+
+template <auto Member>
+void connect_one(typename member_pointer_traits<decltype(Member)>::owner *self,
+                 wl_signal &signal) {
+  using traits = member_pointer_traits<decltype(Member)>;
+  using owner = typename traits::owner;
+  using listener_type = typename traits::member;
+  static_assert(sizeof(listener_type) == sizeof(wl_listener));
+
+  auto *raw = (self->*Member).get();
+  // NOLINTBEGIN
+  member_offset<Member> = reinterpret_cast<std::byte *>(raw) -
+                          reinterpret_cast<std::byte *>(self);
+  // NOLINTEND
+  raw->notify = [](wl_listener *l, void *data) {
+    // NOLINTBEGIN
+    auto *owner_ptr = reinterpret_cast<owner *>(
+        reinterpret_cast<std::byte *>(l) - member_offset<Member>);
+    // NOLINTEND
+    listener_type::handler(owner_ptr, signal_data{data});
+  };
+  wl_signal_add(&signal, raw);
+}
+
+// Adds listeners of one object to signals, pairing each member with the
+// signal in the same position.
+template <auto... Members, typename Struct, typename... Signals>
+void connect(Struct *self, Signals &...signals) {
+  static_assert(sizeof...(Members) == sizeof...(Signals));
+  (connect_one<Members>(self, signals), ...);
+}
 } // namespace detail
 
+// Per-device objects live in fixed-size slabs. Slots of destroyed objects are
+// reused before another slab is allocated, so devices that keep reappearing
+// do not grow memory. Live and free slots are kept on intrusive lists.
+template <typename T, size_t SlabSize = 8> class object_pool {
+public:
+  object_pool() {
+    wl_list_init(&m_live);
+    wl_list_init(&m_free);
+  }
+  object_pool(const object_pool &) = delete;
+  object_pool(object_pool &&) = delete;
+  object_pool &operator=(const object_pool &) = delete;
+  object_pool &operator=(object_pool &&) = delete;
+
+  ~object_pool() {
+    for_each([this](T &object) { destroy(&object); });
+  }
+
+  template <typename... Args> T *create(Args &&...args) {
+    if (wl_list_empty(&m_free) != 0)
+      grow();
+    auto *s = slot::from_link(m_free.next);
+    auto *object = std::construct_at(s->object(), std::forward<Args>(args)...);
+    wl_list_remove(&s->link);
+    wl_list_insert(m_live.prev, &s->link);
+    return object;
+  }
+
+  void destroy(T *object) {
+    auto *s = slot::from_object(object);
+    std::destroy_at(object);
+    wl_list_remove(&s->link);
+    wl_list_insert(&m_free, &s->link);
+  }
+
+  // the callback may destroy the object it is given
+  template <typename F> void for_each(F &&f) {
+    for (auto *link = m_live.next, *next = link->next; link != &m_live;
+         link = next, next = link->next)
+      f(*slot::from_link(link)->object());
+  }
+
+  [[nodiscard]] size_t capacity() const { return m_slabs.size() * SlabSize; }
+
+private:
+  struct slot {
+    wl_list link;
+    alignas(T) std::byte storage[sizeof(T)];
+
+    T *object() { return std::launder(reinterpret_cast<T *>(storage)); }
+
+    // NOLINTBEGIN
+    static slot *from_link(wl_list *link) {
+      return reinterpret_cast<slot *>(reinterpret_cast<std::byte *>(link) -
+                                      offsetof(slot, link));
+    }
+    static slot *from_object(T *object) {
+      return reinterpret_cast<slot *>(reinterpret_cast<std::byte *>(object) -
+                                      offsetof(slot, storage));
+    }
+    // NOLINTEND
+  };
+
+  void grow() {
+    auto &slab = m_slabs.emplace_back(std::make_unique<slot[]>(SlabSize));
+    for (size_t i = 0; i < SlabSize; ++i)
+      wl_list_insert(m_free.prev, &slab[i].link);
+    wlr_log(WLR_DEBUG, "Object pool grown to %zu slots", capacity());
+  }
+
+  wl_list m_live{};
+  wl_list m_free{};
+  std::vector<unique_ptr<slot[]>> m_slabs;
+};
+
+// Lets other threads hand work to the compositor thread. Producers push onto
+// a lock-free stack and only the push that finds it empty writes the
+// eventfd, so the loop wakes once per batch and runs it in posting order.
+class command_queue {
+public:
+  explicit command_queue(wl_event_loop *loop)
+      : m_eventfd(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {
+    m_source = event_source{wl_event_loop_add_fd(
+        loop, m_eventfd, WL_EVENT_READABLE,
+        [](int fd, uint32_t, void *data) {
+          uint64_t count{};
+          [[maybe_unused]] auto n = ::read(fd, &count, sizeof(count));
+          static_cast<command_queue *>(data)->run();
+          return 0;
+        },
+        this)};
+  }
+  command_queue(const command_queue &) = delete;
+  command_queue(command_queue &&) = delete;
+  command_queue &operator=(const command_queue &) = delete;
+  command_queue &operator=(command_queue &&) = delete;
+
+  ~command_queue() {
+    m_source = event_source{};
+    ::close(m_eventfd);
+    // commands that never ran are dropped
+    for (auto *n = m_head.exchange(nullptr, std::memory_order_acquire);
+         n != nullptr;)
+      delete std::exchange(n, n->next);
+  }
+
+  // may be called from any thread
+  void post(std::function<void()> fn) {
+    auto *n = new node{std::move(fn), nullptr};
+    // n may be run and freed as soon as it is published, so only the
+    // previous head is looked at afterwards
+    auto *prev = m_head.load(std::memory_order_relaxed);
+    do {
+      n->next = prev;
+    } while (!m_head.compare_exchange_weak(prev, n, std::memory_order_release,
+                                           std::memory_order_relaxed));
+    if (prev == nullptr) {
+      const uint64_t one = 1;
+      [[maybe_unused]] auto w = ::write(m_eventfd, &one, sizeof(one));
+    }
+  }
+
+private:
+  struct node {
+    std::function<void()> fn;
+    node *next;
+  };
+
+  void run() {
+    // the stack is newest first
+    node *batch = nullptr;
+    auto *n = m_head.exchange(nullptr, std::memory_order_acquire);
+    while (n != nullptr) {
+      auto *next = n->next;
+      n->next = batch;
+      batch = n;
+      n = next;
+    }
+    while (batch != nullptr) {
+      unique_ptr<node> current{std::exchange(batch, batch->next)};
+      current->fn();
+    }
+  }
+
+  int m_eventfd;
+  event_source m_source;
+  std::atomic<node *> m_head{nullptr};
+};
+
+// Keymaps are compiled once per set of RMLVO names on a worker thread and
+// shared by every keyboard using those names.
+class keymap_cache {
+public:
+  struct rule_names {
+    std::string rules;
+    std::string model;
+    std::string layout;
+    std::string variant;
+    std::string options;
+
+    auto operator<=>(const rule_names &) const = default;
+
+    static rule_names from_env() {
+      auto env = [](const char *name) {
+        const char *value = std::getenv(name);
+        return std::string{value != nullptr ? value : ""};
+      };
+      return {env("XKB_DEFAULT_RULES"), env("XKB_DEFAULT_MODEL"),
+              env("XKB_DEFAULT_LAYOUT"), env("XKB_DEFAULT_VARIANT"),
+              env("XKB_DEFAULT_OPTIONS")};
+    }
+  };
+
+  explicit keymap_cache(command_queue &commands)
+      : m_commands(&commands),
+        m_context(xkb_context_new(XKB_CONTEXT_NO_FLAGS)) {}
+  keymap_cache(const keymap_cache &) = delete;
+  keymap_cache(keymap_cache &&) = delete;
+  keymap_cache &operator=(const keymap_cache &) = delete;
+  keymap_cache &operator=(keymap_cache &&) = delete;
+
+  ~keymap_cache() {
+    m_entries.clear(); // joins the workers
+    xkb_context_unref(m_context);
+  }
+
+  // Returns the keymap if it has been compiled, otherwise starts compiling it
+  // and returns nullptr; ready(names) is emitted once it is available.
+  xkb_keymap *find_or_compile(const rule_names &names) {
+    auto [it, inserted] = m_entries.try_emplace(names);
+    auto &e = it->second;
+    if (inserted) {
+      e = std::make_unique<entry>();
+      e->worker = std::jthread([this, names, e = e.get()]() {
+        auto or_null = [](const std::string &str) {
+          return str.empty() ? nullptr : str.c_str();
+        };
+        const xkb_rule_names xkb_names = {
+            or_null(names.rules), or_null(names.model), or_null(names.layout),
+            or_null(names.variant), or_null(names.options)};
+        {
+          // the context and its reference count are not thread safe
+          std::lock_guard lock{m_context_mutex};
+          e->keymap = xkb_keymap_new_from_names(m_context, &xkb_names,
+                                                XKB_KEYMAP_COMPILE_NO_FLAGS);
+        }
+        e->compiled.store(true, std::memory_order_release);
+        m_commands->post([this] { deliver(); });
+      });
+    }
+    return e->delivered ? e->keymap : nullptr;
+  }
+
+  wl_signal &ready(const rule_names &names) {
+    return m_entries.at(names)->ready;
+  }
+
+private:
+  struct entry {
+    entry() { wl_signal_init(&ready); }
+    entry(const entry &) = delete;
+    entry(entry &&) = delete;
+    entry &operator=(const entry &) = delete;
+    entry &operator=(entry &&) = delete;
+    ~entry() {
+      if (worker.joinable())
+        worker.join();
+      if (keymap != nullptr)
+        xkb_keymap_unref(keymap);
+    }
+
+    xkb_keymap *keymap = nullptr; // owned by the worker until delivered
+    std::atomic<bool> compiled{false};
+    bool delivered = false;
+    wl_signal ready{};
+    std::jthread worker;
+  };
+
+  void deliver() {
+    for (auto &[names, e] : m_entries) {
+      if (e->delivered || !e->compiled.load(std::memory_order_acquire))
+        continue;
+      e->worker.join();
+      e->delivered = true;
+      if (e->keymap == nullptr)
+        wlr_log(WLR_ERROR, "Failed to compile keymap (layout '%s')",
+                names.layout.c_str());
+      wl_signal_emit(&e->ready, e->keymap);
+    }
+  }
+
+  command_queue *m_commands;
+  xkb_context *m_context;
+  std::mutex m_context_mutex;
+  std::map<rule_names, unique_ptr<entry>> m_entries;
+};
+
+// Loads the cursor theme into an xcursor manager on a worker thread, so the
+// compositor thread never reads theme files. wlr_cursor loads any scale it
+// does not find in its manager on the spot, so a new scale means a new
+// manager with every scale so far, which replaces the old one once it is
+// complete. Scales are only handed to wlr_cursor after that.
+class cursor_theme_cache {
+public:
+  cursor_theme_cache(command_queue &commands, const char *theme, uint32_t size)
+      : m_commands(&commands), m_theme(theme != nullptr ? theme : ""),
+        m_size(size) {
+    wl_signal_init(&m_ready);
+  }
+  cursor_theme_cache(const cursor_theme_cache &) = delete;
+  cursor_theme_cache(cursor_theme_cache &&) = delete;
+  cursor_theme_cache &operator=(const cursor_theme_cache &) = delete;
+  cursor_theme_cache &operator=(cursor_theme_cache &&) = delete;
+
+  ~cursor_theme_cache() {
+    if (m_worker.joinable())
+      m_worker.join();
+    // a result that never reached the loop
+    if (m_result != nullptr)
+      wlr_xcursor_manager_destroy(m_result);
+    if (m_manager != nullptr)
+      wlr_xcursor_manager_destroy(m_manager);
+  }
+
+  // nullptr until the first scale is loaded
+  [[nodiscard]] wlr_xcursor_manager *manager() const { return m_manager; }
+
+  [[nodiscard]] bool loaded(float scale) const {
+    return std::ranges::find(m_loaded, scale) != m_loaded.end();
+  }
+
+  // starts loading the theme at this scale unless that happened already
+  void request(float scale) {
+    if (std::ranges::find(m_wanted, scale) != m_wanted.end())
+      return;
+    m_wanted.push_back(scale);
+    if (!m_worker.joinable())
+      start();
+  }
+
+  // emitted with the new manager once it replaced the old one, which is
+  // destroyed after the listeners have moved off it
+  wl_signal &ready() { return m_ready; }
+
+private:
+  // one worker at a time; scales requested meanwhile wait for the next one
+  void start() {
+    m_worker = std::jthread([this, scales = m_wanted]() {
+      // theme files are parsed without any shared state, and nothing else
+      // sees the manager until it is delivered
+      auto *manager = wlr_xcursor_manager_create(
+          m_theme.empty() ? nullptr : m_theme.c_str(), m_size);
+      for (float scale : scales)
+        if (!wlr_xcursor_manager_load(manager, scale))
+          wlr_log(WLR_ERROR, "Failed to load cursor theme at scale %.2f",
+                  scale);
+      m_result = manager;
+      m_commands->post([this, scales] { deliver(scales); });
+    });
+  }
+
+  void deliver(std::vector<float> scales) {
+    m_worker.join();
+    auto *old = std::exchange(m_manager, std::exchange(m_result, nullptr));
+    m_loaded = std::move(scales);
+    wl_signal_emit(&m_ready, m_manager);
+    if (old != nullptr)
+      wlr_xcursor_manager_destroy(old);
+    if (m_loaded.size() != m_wanted.size())
+      start();
+  }
+
+  command_queue *m_commands;
+  std::string m_theme;
+  uint32_t m_size;
+  wl_signal m_ready{};
+  std::vector<float> m_wanted;
+  std::vector<float> m_loaded;
+  wlr_xcursor_manager *m_manager = nullptr;
+  // written by the worker until delivered
+  wlr_xcursor_manager *m_result = nullptr;
+  std::jthread m_worker;
+};
+
+inline int64_t timespec_to_nsec(const timespec &ts) {
+  return static_cast<int64_t>(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+inline int64_t now_nsec(clockid_t clock) {
+  timespec ts{};
+  clock_gettime(clock, &ts);
+  return timespec_to_nsec(ts);
+}
+
+class idle_policy;
+
+class idle_inhibitor {
+public:
+  idle_inhibitor(idle_policy &policy, wlr_idle_inhibitor_v1 *inhibitor)
+      : m_policy(&policy) {
+    detail::connect<&idle_inhibitor::m_listener_destroy>(
+        this, inhibitor->events.destroy);
+  }
+  idle_inhibitor(const idle_inhibitor &) = delete;
+  idle_inhibitor(idle_inhibitor &&) = delete;
+  idle_inhibitor &operator=(const idle_inhibitor &) = delete;
+  idle_inhibitor &operator=(idle_inhibitor &&) = delete;
+
+private:
+  idle_policy *m_policy;
+
+  void destroy();
+
+  template <auto Handler> using listener = detail::listener<Handler>;
+
+  listener<[](auto *self, void *) { self->destroy(); }> m_listener_destroy;
+};
+
+// Turns the outputs off once there has been no input for the timeout and
+// back on with the next input, unless a client inhibits idling. The same
+// activity drives ext-idle-notify for clients.
+class idle_policy {
+public:
+  // the loop's timers count milliseconds in an int
+  static constexpr unsigned int max_timeout_sec = 7 * 24 * 60 * 60;
+
+  // a timeout of 0 keeps the outputs on
+  idle_policy(display &display, seat &seat, unsigned int timeout_sec)
+      : m_seat(&seat),
+        m_timeout_nsec(static_cast<int64_t>(timeout_sec) * 1'000'000'000),
+        m_notifier(display.init_idle_notifier()),
+        m_inhibit_manager(display.init_idle_inhibit_manager()) {
+    wl_signal_init(&m_idle_changed);
+    m_timer = event_source{wl_event_loop_add_timer(
+        display.get_event_loop(),
+        [](void *data) {
+          static_cast<idle_policy *>(data)->check();
+          return 0;
+        },
+        this)};
+    detail::connect<&idle_policy::m_listener_new_inhibitor>(
+        this, m_inhibit_manager->events.new_inhibitor);
+    arm(m_timeout_nsec);
+  }
+  idle_policy(const idle_policy &) = delete;
+  idle_policy(idle_policy &&) = delete;
+  idle_policy &operator=(const idle_policy &) = delete;
+  idle_policy &operator=(idle_policy &&) = delete;
+
+  // cheap enough for every input frame: the timer is only re-armed when it
+  // fires early
+  void activity() {
+    m_last_activity = now_nsec(CLOCK_MONOTONIC);
+    wlr_idle_notifier_v1_notify_activity(m_notifier, m_seat->get());
+    if (m_idle)
+      set_idle(false);
+  }
+
+  [[nodiscard]] bool idle() const { return m_idle; }
+
+  // emitted with a bool * whenever the outputs should go off or come back
+  wl_signal &idle_changed() { return m_idle_changed; }
+
+  void remove_inhibitor(idle_inhibitor *inhibitor) {
+    std::erase_if(m_inhibitors, [inhibitor](const idle_inhibitor &x) {
+      return &x == inhibitor;
+    });
+    update_inhibited();
+  }
+
+private:
+  seat *m_seat;
+  int64_t m_timeout_nsec;
+  wlr_idle_notifier_v1 *m_notifier;
+  wlr_idle_inhibit_manager_v1 *m_inhibit_manager;
+  event_source m_timer;
+  wl_signal m_idle_changed{};
+  std::list<idle_inhibitor> m_inhibitors;
+  int64_t m_last_activity = now_nsec(CLOCK_MONOTONIC);
+  bool m_idle = false;
+
+  void arm(int64_t nsec) {
+    if (m_timeout_nsec != 0)
+      m_timer.timer_update(static_cast<int>(nsec / 1'000'000) + 1);
+  }
+
+  void check() {
+    if (m_idle || !m_inhibitors.empty())
+      return;
+    auto quiet = now_nsec(CLOCK_MONOTONIC) - m_last_activity;
+    if (quiet < m_timeout_nsec)
+      arm(m_timeout_nsec - quiet);
+    else
+      set_idle(true);
+  }
+
+  void set_idle(bool idle) {
+    m_idle = idle;
+    wlr_log(WLR_INFO, "%s", idle ? "Idle, turning outputs off"
+                                 : "Activity, turning outputs on");
+    if (!idle)
+      arm(m_timeout_nsec);
+    wl_signal_emit(&m_idle_changed, &m_idle);
+  }
+
+  void update_inhibited() {
+    wlr_idle_notifier_v1_set_inhibited(m_notifier, !m_inhibitors.empty());
+    // the timeout starts over once nothing inhibits it anymore
+    if (m_inhibitors.empty()) {
+      m_last_activity = now_nsec(CLOCK_MONOTONIC);
+      arm(m_timeout_nsec);
+    }
+  }
+
+  template <auto Handler> using listener = detail::listener<Handler>;
+
+  listener<[](auto *self, wlr_idle_inhibitor_v1 *inhibitor) {
+    self->m_inhibitors.emplace_back(*self, inhibitor);
+    self->update_inhibited();
+    if (self->m_idle)
+      self->set_idle(false);
+  }> m_listener_new_inhibitor;
+};
+
+inline void idle_inhibitor::destroy() { m_policy->remove_inhibitor(this); }
+
 class keyboard {
 public:
-  explicit keyboard(wlr_keyboard *keyboard) : m_keyboard(keyboard) {
-    m_listener_key.add_to_signal(m_keyboard->events.key);
+  keyboard(object_pool<keyboard> &pool, wlr_keyboard *keyboard,
+           idle_policy &idle)
+      : m_pool(&pool), m_keyboard(keyboard), m_idle(&idle) {
+    detail::connect<&keyboard::m_listener_key, &keyboard::m_listener_destroy>(
+        this, m_keyboard->events.key, m_keyboard->base.events.destroy);
   }
 
   constexpr auto *get() { return m_keyboard; }
@@ -283,232 +1021,2059 @@ public:
     return wlr_keyboard_set_keymap(m_keyboard, keymap);
   }
 
+  void use_keymap(keymap_cache &cache, const keymap_cache::rule_names &names) {
+    if (auto *keymap = cache.find_or_compile(names)) {
+      if (!set_keymap(keymap))
+        wlr_log(WLR_ERROR, "Failed to set keymap on %s", m_keyboard->base.name);
+      return;
+    }
+    detail::connect<&keyboard::m_listener_keymap_ready>(this,
+                                                        cache.ready(names));
+  }
+
 private:
+  object_pool<keyboard> *m_pool;
   wlr_keyboard *m_keyboard;
+  idle_policy *m_idle;
+
+  template <auto Handler> using listener = detail::listener<Handler>;
+
+  listener<[](auto *self, xkb_keymap *keymap) {
+    self->m_listener_keymap_ready.remove();
+    if (keymap != nullptr && !self->set_keymap(keymap))
+      wlr_log(WLR_ERROR, "Failed to set keymap on %s",
+              self->m_keyboard->base.name);
+  }> m_listener_keymap_ready;
+
+  listener<[](auto *self, wlr_keyboard_key_event *event) {
+    wlr_log(WLR_DEBUG, "Key event: %d state: %d", event->keycode,
+            event->state);
+    self->m_idle->activity();
+  }> m_listener_key;
+  listener<[](auto *self, void *) { self->m_pool->destroy(self); }>
+      m_listener_destroy;
+};
+
+// Wall-clock cost of each startup step, logged once the client has drawn.
+class startup_trace {
+public:
+  void mark(const char *step) {
+    auto now = now_nsec(CLOCK_MONOTONIC);
+    m_steps.push_back({step, now - m_last});
+    m_last = now;
+  }
+
+  void report() const {
+    for (const auto &[step, nsec] : m_steps)
+      wlr_log(WLR_INFO, "startup: %-20s %8.2f ms", step,
+              static_cast<double>(nsec) / 1e6);
+    wlr_log(WLR_INFO, "startup: %-20s %8.2f ms", "total",
+            static_cast<double>(m_last - m_start) / 1e6);
+  }
+
+private:
+  struct step {
+    const char *name;
+    int64_t nsec;
+  };
+
+  int64_t m_start = now_nsec(CLOCK_MONOTONIC);
+  int64_t m_last = m_start;
+  std::vector<step> m_steps;
+};
+
+// Power-of-two microsecond buckets, updated with relaxed atomics so that a
+// reader on another thread never has to stop the frame loop.
+class histogram {
+public:
+  static constexpr size_t bucket_count = 24;
+
+  void record(int64_t nsec) {
+    auto usec = static_cast<uint64_t>(std::max<int64_t>(nsec, 0)) / 1000;
+    auto bucket = std::min<size_t>(std::bit_width(usec), bucket_count - 1);
+    m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum_nsec.fetch_add(static_cast<uint64_t>(std::max<int64_t>(nsec, 0)),
+                         std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] uint64_t count() const {
+    return m_count.load(std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] double mean_usec() const {
+    auto n = count();
+    if (n == 0)
+      return 0;
+    return static_cast<double>(m_sum_nsec.load(std::memory_order_relaxed)) /
+           1e3 / static_cast<double>(n);
+  }
+
+  // upper bound of the bucket holding the given percentile
+  [[nodiscard]] uint64_t percentile_usec(unsigned int percent) const {
+    auto n = count();
+    uint64_t seen = 0;
+    for (size_t i = 0; i < bucket_count; ++i) {
+      seen += m_buckets[i].load(std::memory_order_relaxed);
+      if (seen * 100 >= n * percent)
+        return uint64_t{1} << i;
+    }
+    return uint64_t{1} << (bucket_count - 1);
+  }
+
+private:
+  std::array<std::atomic<uint64_t>, bucket_count> m_buckets{};
+  std::atomic<uint64_t> m_count{0};
+  std::atomic<uint64_t> m_sum_nsec{0};
+};
+
+class frame_stats {
+public:
+  // torn is present for frames flipped without waiting for vblank
+  enum stage : size_t { build, render, commit, present, torn, stage_count };
+
+  void record(stage s, int64_t nsec) { m_stages[s].record(nsec); }
+
+  void record_buffer(bool scanout) {
+    (scanout ? m_scanout : m_composited)
+        .fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void dump(const char *name) const {
+    static constexpr std::array<const char *, stage_count> stage_names = {
+        "build", "render", "commit", "present", "torn"};
+    std::fprintf(stderr, "output %s:\n", name);
+    for (size_t i = 0; i < stage_count; ++i) {
+      const auto &h = m_stages[i];
+      std::fprintf(stderr,
+                   "  %-8s n=%-8" PRIu64 " mean=%9.1f us  p50<=%-7" PRIu64
+                   " us  p99<=%-7" PRIu64 " us\n",
+                   stage_names[i], h.count(), h.mean_usec(),
+                   h.percentile_usec(50), h.percentile_usec(99));
+    }
+    std::fprintf(stderr, "  frames   scanout=%" PRIu64 " composited=%" PRIu64
+                 "\n",
+                 m_scanout.load(std::memory_order_relaxed),
+                 m_composited.load(std::memory_order_relaxed));
+  }
+
+private:
+  std::array<histogram, stage_count> m_stages{};
+  std::atomic<uint64_t> m_scanout{0};
+  std::atomic<uint64_t> m_composited{0};
+};
+
+// 8-bit RGB pixels, kept as binary PPM so that no image library is needed
+struct image {
+  uint32_t width = 0;
+  uint32_t height = 0;
+  std::vector<uint8_t> rgb;
+
+  using file_ptr =
+      unique_ptr<std::FILE, decltype([](std::FILE *f) { std::fclose(f); })>;
+
+  // only works for buffers the CPU can map, e.g. from the pixman renderer
+  static optional<image> from_buffer(wlr_buffer *buffer) {
+    void *data = nullptr;
+    uint32_t format = 0;
+    size_t stride = 0;
+    if (!wlr_buffer_begin_data_ptr_access(
+            buffer, WLR_BUFFER_DATA_PTR_ACCESS_READ, &data, &format, &stride))
+      return {};
+    // little-endian words, so XRGB8888 is laid out as B, G, R, X
+    bool bgrx = format == DRM_FORMAT_XRGB8888 || format == DRM_FORMAT_ARGB8888;
+    bool rgbx = format == DRM_FORMAT_XBGR8888 || format == DRM_FORMAT_ABGR8888;
+    optional<image> result;
+    if (bgrx || rgbx) {
+      result.emplace(static_cast<uint32_t>(buffer->width),
+                     static_cast<uint32_t>(buffer->height));
+      auto *out = result->rgb.data();
+      for (uint32_t y = 0; y < result->height; ++y) {
+        const auto *row = static_cast<const uint8_t *>(data) + y * stride;
+        for (uint32_t x = 0; x < result->width; ++x, out += 3) {
+          const auto *px = row + static_cast<size_t>(x) * 4;
+          out[0] = px[bgrx ? 2 : 0];
+          out[1] = px[1];
+          out[2] = px[bgrx ? 0 : 2];
+        }
+      }
+    }
+    wlr_buffer_end_data_ptr_access(buffer);
+    return result;
+  }
+
+  static optional<image> read_ppm(const char *path) {
+    file_ptr f{std::fopen(path, "rb")};
+    unsigned int width = 0;
+    unsigned int height = 0;
+    unsigned int max = 0;
+    // a single whitespace byte separates the header from the pixels
+    if (f == nullptr ||
+        std::fscanf(f.get(), "P6 %u %u %u", &width, &height, &max) != 3 ||
+        max != 255 || std::fgetc(f.get()) == EOF)
+      return {};
+    image result{width, height};
+    if (std::fread(result.rgb.data(), 1, result.rgb.size(), f.get()) !=
+        result.rgb.size())
+      return {};
+    return result;
+  }
+
+  bool write_ppm(const char *path) const {
+    file_ptr f{std::fopen(path, "wb")};
+    return f != nullptr &&
+           std::fprintf(f.get(), "P6\n%u %u\n255\n", width, height) > 0 &&
+           std::fwrite(rgb.data(), 1, rgb.size(), f.get()) == rgb.size();
+  }
+
+  image() = default;
+  image(uint32_t w, uint32_t h)
+      : width(w), height(h), rgb(static_cast<size_t>(w) * h * 3) {}
+};
+
+// Estimates a client's frame rate from the spacing of its buffer commits
+// and counts the frames that break that rhythm. The rate is taken over a
+// window of intervals rather than from a typical one, as content paced by
+// vblanks alternates intervals, e.g. 24 fps on 60 Hz commits 3:2.
+class frame_cadence {
+public:
+  static constexpr size_t window = 32;
+
+  void record(int64_t nsec) {
+    if (m_last_nsec != 0) {
+      auto interval = nsec - m_last_nsec;
+      // a dropped or doubled frame
+      if (m_period_nsec != 0 && (interval > m_period_nsec * 3 / 2 ||
+                                 interval < m_period_nsec / 2))
+        ++m_stutters;
+      m_intervals[m_recorded++ % window] = interval;
+      if (m_recorded >= window)
+        update_period();
+    }
+    m_last_nsec = nsec;
+  }
 
-  template <typename Data>
-  using listener = detail::listener_base<keyboard, Data>;
+  // the content's frame rate once its rhythm is steady, otherwise 0
+  [[nodiscard]] int32_t refresh_mhz() const {
+    return m_period_nsec != 0
+               ? static_cast<int32_t>(1'000'000'000'000 / m_period_nsec)
+               : 0;
+  }
+
+  [[nodiscard]] uint64_t stutters() const { return m_stutters; }
+
+private:
+  std::array<int64_t, window> m_intervals{};
+  size_t m_recorded = 0;
+  int64_t m_last_nsec = 0;
+  int64_t m_period_nsec = 0;
+  uint64_t m_stutters = 0;
+
+  // steady means both halves of the window took within 5% of the same time
+  void update_period() {
+    int64_t older = 0;
+    int64_t newer = 0;
+    for (size_t i = 0; i < window; ++i)
+      (i < window / 2 ? newer : older) +=
+          m_intervals[(m_recorded - 1 - i) % window];
+    bool steady = older > 0 && newer > 0 &&
+                  std::abs(older - newer) * 20 <= std::max(older, newer);
+    m_period_nsec = steady ? (older + newer) / static_cast<int64_t>(window) : 0;
+  }
+};
+
+struct benchmark_options {
+  unsigned int outputs = 1;
+  unsigned int frames = 1000;
+  // frames are written to <dump_dir>/<output>-<frame>.ppm
+  const char *dump_dir = nullptr;
+  // 0 only dumps the last frame of each output
+  unsigned int dump_every = 0;
+};
+
+// Collects commit latencies while headless outputs are driven as fast as the
+// backend allows, and stops the display once enough frames have been seen.
+class benchmark {
+public:
+  // the headless backend arms its frame timer in whole milliseconds
+  static constexpr int32_t refresh_mhz = 1'000'000;
+  static constexpr unsigned int output_width = 1920;
+  static constexpr unsigned int output_height = 1080;
+  // every commit latency is kept until the report
+  static constexpr unsigned int max_outputs = 16;
+  static constexpr unsigned int max_frames = 1'000'000;
+
+  benchmark(display &display, const benchmark_options &options)
+      : m_display(&display), m_options(options) {
+    m_commit_nsec.reserve(static_cast<size_t>(options.outputs) *
+                          options.frames);
+  }
+
+  [[nodiscard]] const auto &options() const { return m_options; }
+
+  // stands in for a client that damages its whole surface every frame;
+  // the colour only depends on the output's own frame so dumps are stable
+  static void animate(wlr_scene_rect *rect, unsigned int frame) {
+    auto shade = static_cast<float>(frame % 256) / 255.F;
+    const std::array<float, 4> color = {shade, 0.5F, 1.F - shade, 1.F};
+    wlr_scene_rect_set_color(rect, color.data());
+  }
+
+  // an output stops once it has committed its own frames, so a fast output
+  // cannot stand in for a slow one
+  [[nodiscard]] bool wants_frame(unsigned int frame) const {
+    return frame < m_options.frames;
+  }
+
+  void record_commit(unsigned int frame, int64_t nsec) {
+    if (m_commit_nsec.empty()) {
+      m_wall_start = now_nsec(CLOCK_MONOTONIC);
+      m_cpu_start = now_nsec(CLOCK_PROCESS_CPUTIME_ID);
+    }
+    m_commit_nsec.push_back(nsec);
+    if (frame + 1 == m_options.frames &&
+        ++m_outputs_done == m_options.outputs) {
+      m_wall_end = now_nsec(CLOCK_MONOTONIC);
+      m_cpu_end = now_nsec(CLOCK_PROCESS_CPUTIME_ID);
+      m_display->terminate();
+    }
+  }
+
+  void dump(const char *output_name, unsigned int frame,
+            wlr_buffer *buffer) const {
+    if (m_options.dump_dir == nullptr)
+      return;
+    unsigned int every =
+        m_options.dump_every != 0 ? m_options.dump_every : m_options.frames;
+    if ((frame + 1) % every != 0)
+      return;
+    auto path = std::string{m_options.dump_dir} + "/" + output_name + "-" +
+                std::to_string(frame) + ".ppm";
+    auto frame_image = image::from_buffer(buffer);
+    if (!frame_image.has_value())
+      wlr_log(WLR_ERROR, "Cannot read back frame %u of %s", frame,
+              output_name);
+    else if (!frame_image->write_ppm(path.c_str()))
+      wlr_log(WLR_ERROR, "Failed to write %s", path.c_str());
+  }
+
+  // returns false if the run was cut short, e.g. by SIGINT
+  bool report() const {
+    if (m_wall_end == 0 || m_commit_nsec.size() < 2) {
+      std::printf("benchmark: stopped after %zu of %zu frames\n",
+                  m_commit_nsec.size(),
+                  static_cast<size_t>(m_options.outputs) * m_options.frames);
+      return false;
+    }
+    auto sorted = m_commit_nsec;
+    auto percentile = [&sorted](size_t p) {
+      auto it = sorted.begin() +
+                static_cast<std::ptrdiff_t>((sorted.size() - 1) * p / 100);
+      std::nth_element(sorted.begin(), it, sorted.end());
+      return static_cast<double>(*it) / 1e6;
+    };
+    // the first commit only starts the clocks
+    auto frames = static_cast<double>(m_commit_nsec.size() - 1);
+    auto wall = static_cast<double>(m_wall_end - m_wall_start) / 1e9;
+    auto cpu = static_cast<double>(m_cpu_end - m_cpu_start) / 1e6;
+    auto total = std::accumulate(m_commit_nsec.begin(), m_commit_nsec.end(),
+                                 int64_t{0});
+    std::printf("benchmark: %zu frames on %u outputs in %.3f s\n",
+                m_commit_nsec.size(), m_options.outputs, wall);
+    // frames that take less than a timer tick all show up as the timer rate,
+    // so the time spent in each frame is what shows a regression
+    std::printf("  frames/sec:     %.1f (at most %d per output)\n",
+                frames / wall, refresh_mhz / 1000);
+    std::printf("  frame mean:     %.3f ms\n",
+                static_cast<double>(total) / 1e6 /
+                    static_cast<double>(m_commit_nsec.size()));
+    std::printf("  frame p50:      %.3f ms\n", percentile(50));
+    std::printf("  frame p99:      %.3f ms\n", percentile(99));
+    std::printf("  cpu time/frame: %.3f ms\n", cpu / frames);
+    return true;
+  }
+
+private:
+  display *m_display;
+  benchmark_options m_options;
+  std::vector<int64_t> m_commit_nsec;
+  unsigned int m_outputs_done = 0;
+  int64_t m_wall_start = 0;
+  int64_t m_wall_end = 0;
+  int64_t m_cpu_start = 0;
+  int64_t m_cpu_end = 0;
+};
+
+struct supervisor_options {
+  bool restart = false;
+  // keeps a second instance connected but hidden, ready to take over
+  bool spare = false;
+};
+
+// Runs the kiosk client and, if asked to, replaces it whenever it exits.
+// A crash is answered by promoting the spare, or by a cold start once the
+// backoff has passed.
+class supervisor {
+public:
+  // clients that ran at least this long are restarted without delay
+  static constexpr int64_t stable_nsec = 10'000'000'000;
+  static constexpr int min_backoff_ms = 100;
+  static constexpr int max_backoff_ms = 10'000;
+
+  supervisor(wl_event_loop *loop, std::vector<std::string> command,
+             const supervisor_options &options)
+      : m_command(std::move(command)), m_options(options) {
+    m_restart_source = event_source{wl_event_loop_add_timer(
+        loop,
+        [](void *data) {
+          static_cast<supervisor *>(data)->restart();
+          return 0;
+        },
+        this)};
+  }
+
+  bool start() {
+    m_primary = spawn();
+    m_started_nsec = now_nsec(CLOCK_MONOTONIC);
+    if (m_primary != 0 && m_options.spare)
+      m_spare = spawn();
+    return m_primary != 0;
+  }
+
+  [[nodiscard]] pid_t primary() const { return m_primary; }
+  [[nodiscard]] bool is_spare(pid_t pid) const {
+    return pid != 0 && pid == m_spare;
+  }
+
+  // Wrapper scripts and launchers often run the actual client as their
+  // child, so a client is matched to the spawned process it descends from.
+  // Returns pid itself for clients that were not spawned here, or whose
+  // parent already exited.
+  [[nodiscard]] pid_t spawned_ancestor(pid_t pid) const {
+    pid_t p = pid;
+    // bounded, in case pid reuse ever makes the chain loop
+    for (int depth = 0; depth < 64 && p > 1; ++depth, p = parent_of(p))
+      if (p == m_primary || p == m_spare)
+        return p;
+    return pid;
+  }
+
+  // Stops restarting and asks the clients to quit; returns whether the
+  // primary still has to be waited for.
+  bool stop() {
+    m_stopping = true;
+    for (pid_t pid : {m_primary, m_spare})
+      if (pid != 0)
+        ::kill(pid, SIGTERM);
+    return m_primary != 0;
+  }
+
+  // Returns false once the compositor should exit with exit_code().
+  bool child_exited(pid_t pid, int status) {
+    auto now = now_nsec(CLOCK_MONOTONIC);
+    if (pid == m_spare) {
+      wlr_log(WLR_ERROR, "Spare client %d exited with status %d", pid, status);
+      m_spare = 0;
+      // a spare is not expected to exit at all
+      m_backoff_ms = std::clamp(m_backoff_ms * 2, min_backoff_ms,
+                                max_backoff_ms);
+      schedule_restart();
+      return true;
+    }
+    if (pid != m_primary)
+      return true;
+    wlr_log(WLR_INFO, "Client %d exited with status %d", pid, status);
+    m_primary = 0;
+    m_status = status;
+    if (m_stopping || !m_options.restart)
+      return false;
+
+    ++m_restarts;
+    m_died_nsec = now;
+    m_backoff_ms = now - m_started_nsec >= stable_nsec
+                       ? 0
+                       : std::clamp(m_backoff_ms * 2, min_backoff_ms,
+                                    max_backoff_ms);
+    if (m_spare != 0) {
+      m_primary = std::exchange(m_spare, 0);
+      m_started_nsec = now;
+      wlr_log(WLR_INFO, "Promoted spare client %d", m_primary);
+    }
+    schedule_restart();
+    return true;
+  }
+
+  // the replacement is on screen, which ends the outage
+  void client_shown(pid_t pid) {
+    if (pid != m_primary || m_died_nsec == 0)
+      return;
+    m_restart_latency.record(now_nsec(CLOCK_MONOTONIC) - m_died_nsec);
+    m_died_nsec = 0;
+  }
+
+  // the client's exit status, like cage
+  [[nodiscard]] int exit_code() const {
+    if (WIFEXITED(m_status))
+      return WEXITSTATUS(m_status);
+    return WIFSIGNALED(m_status) ? 128 + WTERMSIG(m_status) : 0;
+  }
+
+  void dump() const {
+    std::fprintf(stderr,
+                 "client: %u restarts, restart latency mean=%.1f us "
+                 "p50<=%" PRIu64 " us p99<=%" PRIu64 " us\n",
+                 m_restarts, m_restart_latency.mean_usec(),
+                 m_restart_latency.percentile_usec(50),
+                 m_restart_latency.percentile_usec(99));
+  }
+
+private:
+  std::vector<std::string> m_command;
+  supervisor_options m_options;
+  event_source m_restart_source;
+  pid_t m_primary = 0;
+  pid_t m_spare = 0;
+  int m_status = 0;
+  bool m_stopping = false;
+  int m_backoff_ms = 0;
+  int64_t m_started_nsec = 0;
+  int64_t m_died_nsec = 0;
+  unsigned int m_restarts = 0;
+  histogram m_restart_latency;
+
+  // the parent the kernel reports for pid, or 0 if pid is gone
+  static pid_t parent_of(pid_t pid) {
+    auto path = "/proc/" + std::to_string(pid) + "/stat";
+    auto *f = std::fopen(path.c_str(), "r");
+    if (f == nullptr)
+      return 0;
+    std::array<char, 512> line{};
+    bool read = std::fgets(line.data(), line.size(), f) != nullptr;
+    std::fclose(f);
+    // the command name may contain spaces and parentheses; the state and
+    // the parent follow its last closing parenthesis
+    const char *rest = read ? std::strrchr(line.data(), ')') : nullptr;
+    pid_t ppid = 0;
+    if (rest == nullptr || std::sscanf(rest + 1, " %*c %d", &ppid) != 1)
+      return 0;
+    return ppid;
+  }
+
+  pid_t spawn() {
+    std::vector<char *> argv;
+    for (auto &arg : m_command)
+      argv.push_back(arg.data());
+    argv.push_back(nullptr);
+    ::posix_spawnattr_t attr{};
+    ::posix_spawnattr_init(&attr);
+    // undo the signal mask the event loop installed
+    sigset_t mask{};
+    sigemptyset(&mask);
+    ::posix_spawnattr_setsigmask(&attr, &mask);
+    ::posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    pid_t pid{};
+    int err =
+        ::posix_spawnp(&pid, argv[0], nullptr, &attr, argv.data(), environ);
+    ::posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+      wlr_log(WLR_ERROR, "Failed to spawn %s: %s", argv[0],
+              std::strerror(err));
+      return 0;
+    }
+    wlr_log(WLR_INFO, "Spawned %s as %d", argv[0], pid);
+    return pid;
+  }
+
+  void schedule_restart() {
+    if (m_backoff_ms == 0)
+      restart();
+    else
+      m_restart_source.timer_update(m_backoff_ms);
+  }
+
+  // fills whichever of the two slots is empty
+  void restart() {
+    if (m_stopping)
+      return;
+    if (m_primary == 0) {
+      m_primary = spawn();
+      m_started_nsec = now_nsec(CLOCK_MONOTONIC);
+      if (m_primary == 0) {
+        m_backoff_ms = std::clamp(m_backoff_ms * 2, min_backoff_ms,
+                                  max_backoff_ms);
+        m_restart_source.timer_update(m_backoff_ms);
+        return;
+      }
+    }
+    if (m_spare == 0 && m_options.spare)
+      m_spare = spawn();
+  }
+};
 
-  listener<wlr_keyboard_key_event> m_listener_key{
-      this, [](keyboard *self, wlr_keyboard_key_event *event) {
-        wlr_log(WLR_DEBUG, "Key event: %d state: %d", event->keycode,
-                event->state);
-      }};
-  listener<void> m_listener_destroy{
-      this, [](keyboard *self, void *) { delete self; }};
+struct server_options {
+  // 0 keeps the outputs on
+  unsigned int idle_timeout_sec = 0;
+  bool adaptive_sync = false;
+  // switch modes to a whole multiple of the fullscreen client's frame rate
+  bool match_refresh = false;
+  // alternate vsynced and torn flips while scanning out, to compare their
+  // latency no matter what the client asked for
+  bool compare_tearing = false;
+  // the headless backend without benchmarking, for the hotplug stress test
+  bool headless = false;
+};
+
+class server;
+
+// Each output is driven by its own frame events, so heads with different
+// refresh rates are committed independently.
+class output {
+public:
+  output(server &server, wlr_output *output);
+  output(const output &) = delete;
+  output(output &&) = delete;
+  output &operator=(const output &) = delete;
+  output &operator=(output &&) = delete;
+  ~output() {
+    if (m_benchmark_rect != nullptr)
+      wlr_scene_node_destroy(&m_benchmark_rect->node);
+    wlr_scene_timer_finish(&m_timer);
+    if (m_scene_output != nullptr)
+      wlr_scene_output_destroy(m_scene_output);
+  }
+
+  constexpr auto *get() { return m_output; }
+
+  [[nodiscard]] const auto &stats() const { return m_stats; }
+  [[nodiscard]] const char *name() const { return m_output->name; }
+
+  // Switches to the mode at the current size whose refresh is the highest
+  // whole multiple of the content rate, so every frame is shown for the same
+  // number of vblanks. The current mode is kept if it already is one.
+  void match_refresh(int32_t content_mhz) {
+    auto *current = m_output->current_mode;
+    if (current == nullptr || content_mhz <= 0)
+      return;
+    auto is_multiple = [content_mhz](const wlr_output_mode *mode) {
+      auto ratio = static_cast<double>(mode->refresh) / content_mhz;
+      auto n = std::round(ratio);
+      return n >= 1. && std::abs(ratio - n) <= 0.005 * n;
+    };
+    if (is_multiple(current))
+      return;
+    wlr_output_mode *best = nullptr;
+    wlr_output_mode *mode = nullptr;
+    wl_list_for_each(mode, &m_output->modes, link) {
+      if (mode->width == current->width && mode->height == current->height &&
+          is_multiple(mode) &&
+          (best == nullptr || mode->refresh > best->refresh))
+        best = mode;
+    }
+    if (best == nullptr)
+      return;
+    wlr_output_state state{};
+    wlr_output_state_init(&state);
+    wlr_output_state_set_mode(&state, best);
+    if (wlr_output_commit_state(m_output, &state))
+      wlr_log(WLR_INFO, "Switched %s to %.3f Hz for %.3f Hz content",
+              m_output->name, best->refresh / 1000., content_mhz / 1000.);
+    wlr_output_state_finish(&state);
+  }
+
+  // whether output management last left the output on; idling only turns
+  // those back on
+  [[nodiscard]] bool enabled_by_user() const { return m_enabled_by_user; }
+  void set_enabled_by_user(bool enabled) { m_enabled_by_user = enabled; }
+
+  // Gives the output a scene output at its place in the layout. Removing it
+  // from the layout destroys the scene output, so this is needed again
+  // whenever the output comes back.
+  void add_to_layout(wlr_output_layout_output *l_output);
+
+  // a new output joins the layout once the cursor theme is loaded at its
+  // scale
+  void cursor_theme_loaded();
+
+  // frame events, and with them all rendering, stop while the output is off
+  void set_power(bool on) {
+    wlr_output_state state{};
+    wlr_output_state_init(&state);
+    wlr_output_state_set_enabled(&state, on);
+    if (on && m_output->current_mode != nullptr)
+      wlr_output_state_set_mode(&state, m_output->current_mode);
+    if (!wlr_output_commit_state(m_output, &state))
+      wlr_log(WLR_ERROR, "Failed to turn %s %s", m_output->name,
+              on ? "on" : "off");
+    wlr_output_state_finish(&state);
+  }
+
+private:
+  server *m_server;
+  wlr_output *m_output;
+  wlr_scene_output *m_scene_output = nullptr;
+  bool m_enabled_by_user = true;
+  bool m_waiting_for_cursor_theme = false;
+
+  benchmark *m_benchmark = nullptr;
+  wlr_scene_rect *m_benchmark_rect = nullptr;
+
+  frame_stats m_stats;
+  wlr_scene_timer m_timer{};
+  int64_t m_commit_nsec = 0;
+  unsigned int m_frame = 0;
+  bool m_scanout = false;
+  bool m_torn = false;
+  // the last frame was composited, so the render timer holds its duration
+  bool m_render_timer_pending = false;
+
+  void destroy();
+
+  // The preferred mode first, then the rest from the most demanding down,
+  // so an output the link cannot drive at full rate still lights up.
+  bool set_working_mode(wlr_output_state &state) {
+    std::vector<wlr_output_mode *> modes;
+    wlr_output_mode *mode = nullptr;
+    wl_list_for_each(mode, &m_output->modes, link) {
+      modes.push_back(mode);
+    }
+    if (modes.empty())
+      return wlr_output_test_state(m_output, &state);
+    auto cost = [](const wlr_output_mode *m) {
+      return static_cast<int64_t>(m->width) * m->height * m->refresh;
+    };
+    std::stable_sort(modes.begin(), modes.end(), [&](auto *a, auto *b) {
+      if (a->preferred != b->preferred)
+        return a->preferred;
+      return cost(a) > cost(b);
+    });
+    for (auto *m : modes) {
+      wlr_output_state_set_mode(&state, m);
+      if (!wlr_output_test_state(m_output, &state))
+        continue;
+      if (!m->preferred)
+        wlr_log(WLR_INFO, "Falling back to %dx%d@%.3f Hz on %s", m->width,
+                m->height, m->refresh / 1000., m_output->name);
+      return true;
+    }
+    return false;
+  }
+
+  // the scene buffer whose client buffer is handed straight to the output
+  // instead of a buffer the scene rendered into
+  wlr_scene_buffer *scanout_buffer(const wlr_output_state &state) {
+    if ((state.committed & WLR_OUTPUT_STATE_BUFFER) == 0)
+      return nullptr;
+    struct match {
+      wlr_buffer *buffer;
+      wlr_scene_buffer *found;
+    } m{state.buffer, nullptr};
+    wlr_scene_output_for_each_buffer(
+        m_scene_output,
+        [](wlr_scene_buffer *scene_buffer, int, int, void *data) {
+          auto *m = static_cast<match *>(data);
+          if (scene_buffer->buffer == m->buffer)
+            m->found = scene_buffer;
+        },
+        &m);
+    return m.found;
+  }
+
+  // only a scanned out client can tear, as a composited frame would tear
+  // everything else with it
+  bool wants_tearing(wlr_scene_buffer *scanout);
+
+  // the cursor image for a new scale is ready by the time the pointer
+  // gets there
+  void scale_changed();
+
+  void commit_frame() {
+    // the GPU timer of the previous frame is done by now, and building the
+    // next state would discard it; a scanned out frame never started it
+    if (std::exchange(m_render_timer_pending, false) &&
+        m_timer.render_timer != nullptr) {
+      auto nsec = wlr_render_timer_get_duration_ns(m_timer.render_timer);
+      if (nsec >= 0)
+        m_stats.record(frame_stats::render, nsec);
+    }
+
+    wlr_output_state state{};
+    wlr_output_state_init(&state);
+    const wlr_scene_output_state_options options{.timer = &m_timer};
+    auto start = now_nsec(CLOCK_MONOTONIC);
+    if (wlr_scene_output_build_state(m_scene_output, &state, &options)) {
+      auto built = now_nsec(CLOCK_MONOTONIC);
+      m_stats.record(frame_stats::build, m_timer.pre_render_duration);
+      auto *scanout_from = scanout_buffer(state);
+      bool scanout = scanout_from != nullptr;
+      // without a GPU timer fall back to the CPU side of rendering
+      if (!scanout && m_timer.render_timer == nullptr)
+        m_stats.record(frame_stats::render,
+                       built - start - m_timer.pre_render_duration);
+      m_render_timer_pending = !scanout;
+      if (scanout && wants_tearing(scanout_from)) {
+        state.tearing_page_flip = true;
+        // not every driver can flip asynchronously
+        if (!wlr_output_test_state(m_output, &state))
+          state.tearing_page_flip = false;
+      }
+      if (wlr_output_commit_state(m_output, &state)) {
+        m_torn = state.tearing_page_flip;
+        m_commit_nsec = now_nsec(CLOCK_MONOTONIC);
+        m_stats.record_buffer(scanout);
+        if (scanout != m_scanout)
+          wlr_log(WLR_DEBUG, "Direct scanout %s on %s",
+                  scanout ? "started" : "stopped", m_output->name);
+        m_scanout = scanout;
+        m_stats.record(frame_stats::commit, m_commit_nsec - built);
+        if (m_benchmark != nullptr) {
+          m_benchmark->dump(m_output->name, m_frame, state.buffer);
+          m_benchmark->record_commit(m_frame, m_commit_nsec - start);
+        }
+        ++m_frame;
+      }
+    }
+    wlr_output_state_finish(&state);
+  }
+
+  template <auto Handler> using listener = detail::listener<Handler>;
+
+  listener<[](auto *self, void *) {
+    if (self->m_scene_output == nullptr)
+      return;
+    if (self->m_benchmark != nullptr) {
+      if (!self->m_benchmark->wants_frame(self->m_frame))
+        return;
+      benchmark::animate(self->m_benchmark_rect, self->m_frame);
+    }
+    // nothing damaged: no render, no page flip, and no further frame
+    // events until a client schedules one
+    if (wlr_scene_output_needs_frame(self->m_scene_output))
+      self->commit_frame();
+    timespec now{};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    // only surfaces with queued frame callbacks are notified, which also
+    // covers clients that committed a callback without any damage
+    wlr_scene_output_send_frame_done(self->m_scene_output, &now);
+  }> m_listener_frame;
+
+  listener<[](auto *self, wlr_output_event_present *event) {
+    if (!event->presented || event->when == nullptr ||
+        self->m_commit_nsec == 0)
+      return;
+    self->m_stats.record(self->m_torn ? frame_stats::torn
+                                      : frame_stats::present,
+                         timespec_to_nsec(*event->when) -
+                             self->m_commit_nsec);
+    self->m_commit_nsec = 0;
+  }> m_listener_present;
+
+  listener<[](auto *self, wlr_output_event_request_state *event) {
+    wlr_output_commit_state(self->m_output, event->state);
+  }> m_listener_request_state;
+
+  // scales set by anything but output management, which waits for the
+  // theme itself
+  listener<[](auto *self, wlr_output_event_commit *event) {
+    if ((event->state->committed & WLR_OUTPUT_STATE_SCALE) != 0)
+      self->scale_changed();
+  }> m_listener_commit;
+
+  listener<[](auto *self, void *) {
+    self->m_listener_scene_output_destroy.remove();
+    self->m_scene_output = nullptr;
+  }> m_listener_scene_output_destroy;
+
+  listener<[](auto *self, void *) { self->destroy(); }> m_listener_destroy;
+};
+
+// The kiosk client is kept fullscreen at the size of the primary output and
+// at its origin, so its buffer can be scanned out without compositing.
+class toplevel {
+public:
+  toplevel(server &server, wlr_xdg_toplevel *toplevel);
+  toplevel(const toplevel &) = delete;
+  toplevel(toplevel &&) = delete;
+  toplevel &operator=(const toplevel &) = delete;
+  toplevel &operator=(toplevel &&) = delete;
+
+  constexpr auto *get() { return m_toplevel; }
+  [[nodiscard]] pid_t pid() const { return m_pid; }
+
+  void fit_to_output();
+
+  // whether the last configure placed the client over box at its size
+  [[nodiscard]] bool fits(const wlr_box &box) const {
+    return !m_initialized ||
+           (m_scene_tree->node.x == box.x && m_scene_tree->node.y == box.y &&
+            m_toplevel->scheduled.width == box.width &&
+            m_toplevel->scheduled.height == box.height);
+  }
+
+  void set_visible(bool visible) {
+    wlr_scene_node_set_enabled(&m_scene_tree->node, visible);
+  }
+
+private:
+  server *m_server;
+  wlr_xdg_toplevel *m_toplevel;
+  wlr_scene_tree *m_scene_tree;
+  // the spawned process the client runs under, if any
+  pid_t m_pid = 0;
+  bool m_initialized = false;
+
+  void destroy();
+
+  template <auto Handler> using listener = detail::listener<Handler>;
+
+  listener<[](auto *self, void *) {
+    // the first configure has to answer the initial commit
+    if (self->m_toplevel->base->initial_commit) {
+      self->m_initialized = true;
+      self->fit_to_output();
+    }
+    self->m_server->schedule_hidden_frames();
+    auto *surface = self->m_toplevel->base->surface;
+    if (!self->m_scene_tree->node.enabled ||
+        !wlr_surface_has_buffer(surface))
+      return;
+    self->m_server->client_committed_buffer(self->m_pid);
+    if ((surface->current.committed & WLR_SURFACE_STATE_BUFFER) != 0)
+      self->m_server->client_frame(surface);
+  }> m_listener_commit;
+
+  listener<[](auto *self, void *) {
+    // a kiosk client stays fullscreen, but the request still needs a reply
+    // once the initial commit has been answered
+    if (self->m_toplevel->base->initialized)
+      wlr_xdg_surface_schedule_configure(self->m_toplevel->base);
+  }> m_listener_request_fullscreen;
+
+  listener<[](auto *self, void *) { self->destroy(); }> m_listener_destroy;
 };
 
 class server {
 public:
-  server() {
+  explicit server(const optional<benchmark_options> &benchmark = {},
+                  const server_options &options = {})
+      : m_options(options) {
     m_display = display::try_create().value();
-    m_backend = backend::try_create(m_display).value();
+    m_trace.mark("display");
+    // the loop blocks these signals in this thread and new threads inherit
+    // the mask, so they are added before any helper thread is started
+    for (size_t i = 0; i < handled_signals.size(); ++i)
+      m_signal_sources[i] = event_source{wl_event_loop_add_signal(
+          m_display.get_event_loop(), handled_signals[i],
+          [](int signal_number, void *data) {
+            static_cast<server *>(data)->handle_signal(signal_number);
+            return 0;
+          },
+          this)};
+    m_commands.emplace(m_display.get_event_loop());
+    m_keymaps.emplace(*m_commands);
+    // compile the default keymap while the rest of the server comes up
+    m_keymaps->find_or_compile(keymap_cache::rule_names::from_env());
+    m_cursor_themes.emplace(*m_commands, nullptr, 32);
+    m_cursor_themes->request(1.F);
+    if (benchmark.has_value())
+      m_benchmark.emplace(m_display, *benchmark);
+    m_hidden_frame_source = event_source{wl_event_loop_add_timer(
+        m_display.get_event_loop(),
+        [](void *data) {
+          static_cast<server *>(data)->send_hidden_frames();
+          return 0;
+        },
+        this)};
+  }
+
+  // Creates the backend, renderer and allocator and everything built on
+  // them: globals, scene, cursor and seat. Clients only see the globals
+  // once the loop runs, so this may come after the socket and the client.
+  void create_backend() {
+    m_backend =
+        backend::try_create(m_display,
+                            m_benchmark.has_value() || m_options.headless)
+            .value();
+    m_trace.mark("backend");
     m_renderer = renderer::try_create(m_backend).value();
-    m_renderer.init_wl_display(m_display);
+    m_renderer.init_wl_shm(m_display);
+    m_trace.mark("renderer");
     m_allocator = allocator::try_create(m_backend, m_renderer).value();
+    m_trace.mark("allocator");
 
     m_display.init_compositor(5, m_renderer);
     m_display.init_subcompositor();
     m_display.init_data_device_manager();
+    m_relative_pointer_manager = m_display.init_relative_pointer_manager();
+    m_content_type_manager = m_display.init_content_type_manager(1);
+    m_tearing_control_manager = m_display.init_tearing_control_manager(1);
+    m_output_manager = m_display.init_output_manager();
 
-    m_listener_new_output.add_to_signal(m_backend.events().new_output);
-
-    m_output_layout = output_layout::try_create().value();
+    m_output_layout = output_layout::try_create(m_display).value();
     m_scene = scene::try_create().value();
 
     m_scene_output_layout = m_scene.attach_output_layout(m_output_layout);
+    // the scene sends presentation feedback once the global exists
+    m_display.init_presentation(m_backend);
+    m_scene.set_linux_dmabuf(m_display.init_linux_dmabuf(4, m_renderer));
+    m_trace.mark("globals and scene");
 
     m_cursor = cursor::try_create().value();
     m_cursor.attach_output_layout(m_output_layout);
 
-    m_listener_new_input.add_to_signal(m_backend.events().new_input);
+    m_seat = seat::try_create(m_display, "seat0").value();
+    m_idle.emplace(m_display, m_seat, m_options.idle_timeout_sec);
 
-    m_listener_cursor_motion.add_to_signal(m_cursor.events().motion);
+    m_display.init_xdg_shell(3);
 
-    m_listener_cursor_frame.add_to_signal(m_cursor.events().frame);
+    detail::connect<&server::m_listener_new_output,
+                    &server::m_listener_new_input,
+                    &server::m_listener_cursor_motion,
+                    &server::m_listener_cursor_frame,
+                    &server::m_listener_request_cursor,
+                    &server::m_listener_new_xdg_toplevel,
+                    &server::m_listener_idle_changed,
+                    &server::m_listener_layout_change,
+                    &server::m_listener_output_manager_apply,
+                    &server::m_listener_output_manager_test,
+                    &server::m_listener_cursor_themes_ready>(
+        this, m_backend.events().new_output, m_backend.events().new_input,
+        m_cursor.events().motion, m_cursor.events().frame,
+        m_seat.events().request_set_cursor,
+        m_display.xdg_shell_events().new_toplevel, m_idle->idle_changed(),
+        m_output_layout.get()->events.change, m_output_manager->events.apply,
+        m_output_manager->events.test, m_cursor_themes->ready());
+    m_trace.mark("input and shell");
+  }
 
-    m_seat = seat::try_create(m_display, "seat0").value();
+  auto &get_display() { return m_display; }
+  auto &get_backend() { return m_backend; }
+  auto &get_benchmark() { return m_benchmark; }
 
-    m_listener_request_cursor.add_to_signal(m_seat.events().request_set_cursor);
+  const char *add_socket() {
+    m_socket_nsec = now_nsec(CLOCK_MONOTONIC);
+    const char *socket = m_display.add_socket_auto();
+    m_trace.mark("socket");
+    return socket;
+  }
 
-    m_xcursor_manager = xcursor_manager::try_create(nullptr, 32).value();
+  bool start_backend() {
+    bool started = m_backend.start();
+    m_trace.mark("backend start");
+    return started;
+  }
 
-    m_display.init_xdg_shell(3);
-    m_listener_new_xdg_toplevel.add_to_signal(
-        m_display.xdg_shell_events().new_surface);
+  // time to first frame, as seen from the compositor
+  void client_committed_buffer(pid_t pid) {
+    if (m_supervisor.has_value())
+      m_supervisor->client_shown(pid);
+    if (m_socket_nsec == 0)
+      return;
+    wlr_log(WLR_INFO, "First client buffer %.1f ms after adding the socket",
+            static_cast<double>(now_nsec(CLOCK_MONOTONIC) - m_socket_nsec) /
+                1e6);
+    m_socket_nsec = 0;
+    m_trace.mark("first client buffer");
+    m_trace.report();
   }
 
-  auto &get_display() { return m_display; }
-  auto &get_backend() { return m_backend; }
+  void client_frame(wlr_surface *surface) {
+    m_client_cadence.record(now_nsec(CLOCK_MONOTONIC));
+    if (!m_options.match_refresh)
+      return;
+    // a still image has no rhythm worth following
+    if (wlr_surface_get_content_type_v1(m_content_type_manager, surface) ==
+        WP_CONTENT_TYPE_V1_TYPE_PHOTO)
+      return;
+    auto content_mhz = m_client_cadence.refresh_mhz();
+    // ignore jitter in the estimate itself
+    if (content_mhz == 0 ||
+        std::abs(content_mhz - m_matched_mhz) * 100 <= m_matched_mhz)
+      return;
+    m_matched_mhz = content_mhz;
+    if (auto *o = primary_output())
+      o->match_refresh(content_mhz);
+  }
+
+  // Hidden clients keep a slow heartbeat so they don't stall entirely. The
+  // timer only runs while one of them waits for a frame and the outputs are
+  // on, so an idle kiosk does not wake up for it.
+  void schedule_hidden_frames() {
+    // a client may exit before create_backend() with -E
+    if (m_hidden_frames_scheduled || !m_idle.has_value() || m_idle->idle())
+      return;
+    bool waiting = false;
+    m_scene.for_each_hidden_waiter([&waiting](auto *) { waiting = true; });
+    if (!waiting)
+      return;
+    m_hidden_frame_source.timer_update(hidden_frame_interval_ms);
+    m_hidden_frames_scheduled = true;
+  }
+
+  void process_cursor_motion(uint32_t time_msec) {
+    double sx{};
+    double sy{};
+    auto *surface =
+        m_scene.surface_at(m_cursor.get()->x, m_cursor.get()->y, sx, sy);
+    if (surface == nullptr) {
+      m_cursor.set_xcursor(m_cursor_themes->manager(), "default");
+      m_seat.pointer_clear_focus();
+      return;
+    }
+    // the client sets its own image once it has pointer focus
+    if (m_seat.get()->pointer_state.focused_surface != surface)
+      m_seat.pointer_notify_enter(surface, sx, sy);
+    m_seat.pointer_notify_motion(time_msec, sx, sy);
+  }
+
+  // Motion is summed until the loop has dispatched everything it read from
+  // the input devices, and then delivered once. libinput sends a pointer
+  // frame after each motion, so waiting for that would merge nothing; a
+  // high-rate mouse costs one cursor move and one seat event per dispatch.
+  void queue_cursor_motion() {
+    if (m_motion_flush != nullptr)
+      return;
+    // idle sources are removed once they have run
+    m_motion_flush = wl_event_loop_add_idle(
+        m_display.get_event_loop(),
+        [](void *data) {
+          auto *self = static_cast<server *>(data);
+          self->m_motion_flush = nullptr;
+          self->flush_cursor_motion();
+        },
+        this);
+  }
+
+  void flush_cursor_motion() {
+    if (m_motion.events == 0)
+      return;
+    m_idle->activity();
+    m_cursor.move(m_motion.dx, m_motion.dy, m_motion.device);
+    // the sums keep the raw deltas exact for relative-pointer clients
+    wlr_relative_pointer_manager_v1_send_relative_motion(
+        m_relative_pointer_manager, m_seat.get(),
+        static_cast<uint64_t>(m_motion.time_msec) * 1000, m_motion.dx,
+        m_motion.dy, m_motion.unaccel_dx, m_motion.unaccel_dy);
+    process_cursor_motion(m_motion.time_msec);
+    ++m_motion_delivered;
+    if (m_motion.frame)
+      m_seat.pointer_notify_frame();
+    m_motion = {};
+  }
+
+  bool start_client(std::vector<std::string> command,
+                    const supervisor_options &options) {
+    m_supervisor.emplace(m_display.get_event_loop(), std::move(command),
+                         options);
+    bool started = m_supervisor->start();
+    m_trace.mark("client spawn");
+    return started;
+  }
+
+  void stop_client() {
+    if (m_supervisor.has_value())
+      m_supervisor->stop();
+  }
+
+  [[nodiscard]] int exit_code() const {
+    return m_supervisor.has_value() ? m_supervisor->exit_code() : 0;
+  }
+
+  void dump_stats() const {
+    for (const auto &o : m_outputs)
+      o.stats().dump(o.name());
+    std::fprintf(stderr,
+                 "pointer motion: %" PRIu64 " events in, %" PRIu64
+                 " delivered\n",
+                 m_motion_received, m_motion_delivered);
+    std::fprintf(stderr, "client frames: %.3f Hz, %" PRIu64 " stutters\n",
+                 m_client_cadence.refresh_mhz() / 1000.,
+                 m_client_cadence.stutters());
+    if (m_supervisor.has_value())
+      m_supervisor->dump();
+  }
+
+  void remove_output(output *o) {
+    std::erase_if(m_outputs, [o](const output &x) { return &x == o; });
+  }
+
+  // publishes the current heads to output management clients
+  void update_output_configuration() {
+    auto *config = wlr_output_configuration_v1_create();
+    for (auto &o : m_outputs) {
+      auto *head = wlr_output_configuration_head_v1_create(config, o.get());
+      // an output that is only off while idle is still in use
+      head->state.enabled = o.enabled_by_user();
+      wlr_box box{};
+      wlr_output_layout_get_box(m_output_layout.get(), o.get(), &box);
+      head->state.x = box.x;
+      head->state.y = box.y;
+    }
+    wlr_output_manager_v1_set_configuration(m_output_manager, config);
+  }
+
+  // The whole configuration is tested or committed as one backend-wide
+  // state, so heads that share link bandwidth are checked together and a
+  // commit that fails changes nothing.
+  bool apply_output_configuration(wlr_output_configuration_v1 *config,
+                                  bool test_only) {
+    size_t states_len = 0;
+    auto *states = wlr_output_configuration_v1_build_state(config, &states_len);
+    if (states == nullptr)
+      return false;
+    bool ok = test_only
+                  ? wlr_backend_test(m_backend.get(), states, states_len)
+                  : wlr_backend_commit(m_backend.get(), states, states_len);
+    for (size_t i = 0; i < states_len; ++i)
+      wlr_output_state_finish(&states[i].base);
+    std::free(states); // NOLINT
+    if (!ok || test_only)
+      return ok;
+
+    wlr_output_configuration_head_v1 *head = nullptr;
+    wl_list_for_each(head, &config->heads, link) {
+      auto *o = find_output(head->state.output);
+      if (o == nullptr)
+        continue;
+      o->set_enabled_by_user(head->state.enabled);
+      // a disabled output must not keep the cursor or the client
+      if (head->state.enabled)
+        o->add_to_layout(wlr_output_layout_add(
+            m_output_layout.get(), o->get(), head->state.x, head->state.y));
+      else
+        wlr_output_layout_remove(m_output_layout.get(), o->get());
+    }
+    update_output_configuration();
+    return true;
+  }
+
+  // wlr_cursor loads the image for a new scale on the spot, so applying a
+  // configuration waits until the theme is loaded at each of its scales
+  bool request_cursor_themes(wlr_output_configuration_v1 *config) {
+    bool loaded = true;
+    wlr_output_configuration_head_v1 *head = nullptr;
+    wl_list_for_each(head, &config->heads, link) {
+      if (!head->state.enabled || m_cursor_themes->loaded(head->state.scale))
+        continue;
+      m_cursor_themes->request(head->state.scale);
+      loaded = false;
+    }
+    return loaded;
+  }
+
+  void reply_output_configuration(wlr_output_configuration_v1 *config,
+                                  bool test_only) {
+    if (apply_output_configuration(config, test_only))
+      wlr_output_configuration_v1_send_succeeded(config);
+    else
+      wlr_output_configuration_v1_send_failed(config);
+    wlr_output_configuration_v1_destroy(config);
+  }
+
+  // applies in the order they were requested, each once its scales are in
+  void apply_pending_output_configurations() {
+    while (!m_pending_output_configs.empty() &&
+           request_cursor_themes(m_pending_output_configs.front().get())) {
+      reply_output_configuration(m_pending_output_configs.front().release(),
+                                 false);
+      m_pending_output_configs.erase(m_pending_output_configs.begin());
+    }
+  }
+
+  void remove_toplevel(toplevel *t) {
+    std::erase_if(m_toplevels, [t](const toplevel &x) { return &x == t; });
+  }
+
+  // the first output that is in use
+  output *primary_output() {
+    auto it = std::ranges::find_if(
+        m_outputs, [](const output &o) { return o.enabled_by_user(); });
+    return it != m_outputs.end() ? &*it : nullptr;
+  }
+
+  output *find_output(wlr_output *wlr_output) {
+    auto it = std::ranges::find_if(
+        m_outputs, [wlr_output](output &o) { return o.get() == wlr_output; });
+    return it != m_outputs.end() ? &*it : nullptr;
+  }
+
+  [[nodiscard]] size_t output_count() const { return m_outputs.size(); }
+  [[nodiscard]] size_t toplevel_count() const { return m_toplevels.size(); }
+
+  bool toplevels_fit_primary_output() {
+    wlr_box box{};
+    if (auto *o = primary_output())
+      wlr_output_layout_get_box(m_output_layout.get(), o->get(), &box);
+    return std::ranges::all_of(
+        m_toplevels, [&box](const toplevel &t) { return t.fits(box); });
+  }
+  auto &get_output_layout() { return m_output_layout; }
 
 private:
+  friend class output;
+  friend class toplevel;
+
+  void handle_signal(int signal_number) {
+    switch (signal_number) {
+    case SIGUSR1:
+      dump_stats();
+      break;
+    case SIGCHLD:
+      reap_children();
+      break;
+    default:
+      // the display goes down once the client has been reaped, so that it
+      // can still talk to us while it shuts down
+      if (!m_supervisor.has_value() || !m_supervisor->stop())
+        m_display.terminate();
+      break;
+    }
+  }
+
+  void reap_children() {
+    // SIGCHLD is not queued, so one signal may stand for several children
+    int status = 0;
+    for (pid_t pid{}; (pid = ::waitpid(-1, &status, WNOHANG)) > 0;) {
+      if (!m_supervisor.has_value())
+        continue;
+      if (!m_supervisor->child_exited(pid, status))
+        m_display.terminate();
+      else
+        show_primary_client();
+    }
+  }
+
+  // everything but the spare is on screen, and the primary client has
+  // keyboard focus
+  void show_primary_client() {
+    for (auto &t : m_toplevels) {
+      t.set_visible(!is_spare(t.pid()));
+      if (t.pid() != m_supervisor->primary())
+        continue;
+      focus(t);
+      // a promoted spare has been ready all along
+      if (wlr_surface_has_buffer(t.get()->base->surface))
+        m_supervisor->client_shown(t.pid());
+    }
+    schedule_hidden_frames();
+  }
+
+  [[nodiscard]] bool is_spare(pid_t pid) const {
+    return m_supervisor.has_value() && m_supervisor->is_spare(pid);
+  }
+
+  [[nodiscard]] pid_t spawned_ancestor(pid_t pid) const {
+    return m_supervisor.has_value() ? m_supervisor->spawned_ancestor(pid)
+                                    : pid;
+  }
+
+  void focus(toplevel &t) {
+    auto *kbd = wlr_seat_get_keyboard(m_seat.get());
+    if (kbd != nullptr)
+      wlr_seat_keyboard_notify_enter(m_seat.get(), t.get()->base->surface,
+                                     kbd->keycodes, kbd->num_keycodes,
+                                     &kbd->modifiers);
+  }
+
+  static constexpr int hidden_frame_interval_ms = 1000;
+
+  void send_hidden_frames() {
+    m_hidden_frames_scheduled = false;
+    if (m_idle->idle())
+      return;
+    timespec now{};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    m_scene.for_each_hidden_waiter([&now](wlr_scene_buffer *buffer) {
+      wlr_scene_buffer_send_frame_done(buffer, &now);
+    });
+    // the callbacks are used up, so this only re-arms for clients that
+    // asked again meanwhile
+    schedule_hidden_frames();
+  }
+
+  static constexpr std::array handled_signals = {SIGINT, SIGTERM, SIGCHLD,
+                                                 SIGUSR1};
+
+  server_options m_options;
+  startup_trace m_trace;
   display m_display;
+  std::array<event_source, handled_signals.size()> m_signal_sources;
+  event_source m_hidden_frame_source;
+  bool m_hidden_frames_scheduled = false;
+  // before everything that may post to it
+  optional<command_queue> m_commands;
+  optional<keymap_cache> m_keymaps;
+  optional<cursor_theme_cache> m_cursor_themes;
   backend m_backend;
   renderer m_renderer;
   allocator m_allocator;
 
-  wlr_output *m_last_output;
+  optional<benchmark> m_benchmark;
+  int64_t m_socket_nsec = 0;
+  optional<supervisor> m_supervisor;
 
   scene m_scene;
   output_layout m_output_layout;
 
   wlr_scene_output_layout *m_scene_output_layout;
 
+  std::list<output> m_outputs;
+  std::list<toplevel> m_toplevels;
+  object_pool<keyboard> m_keyboards;
+
+  struct pending_motion {
+    wlr_input_device *device = nullptr;
+    uint32_t time_msec = 0;
+    double dx = 0.;
+    double dy = 0.;
+    double unaccel_dx = 0.;
+    double unaccel_dy = 0.;
+    unsigned int events = 0;
+    // the frame that ended the motion is sent after it
+    bool frame = false;
+  } m_motion;
+  wl_event_source *m_motion_flush = nullptr;
+  uint64_t m_motion_received = 0;
+  uint64_t m_motion_delivered = 0;
+  wlr_relative_pointer_manager_v1 *m_relative_pointer_manager = nullptr;
+
+  wlr_content_type_manager_v1 *m_content_type_manager = nullptr;
+  wlr_tearing_control_manager_v1 *m_tearing_control_manager = nullptr;
+  wlr_output_manager_v1 *m_output_manager = nullptr;
+  using output_configuration_ptr =
+      unique_ptr<wlr_output_configuration_v1,
+                 decltype([](wlr_output_configuration_v1 *config) {
+                   wlr_output_configuration_v1_destroy(config);
+                 })>;
+  // applies waiting for cursor themes, oldest first
+  std::vector<output_configuration_ptr> m_pending_output_configs;
+  frame_cadence m_client_cadence;
+  int32_t m_matched_mhz = 0;
+
   cursor m_cursor;
   seat m_seat;
-
-  xcursor_manager m_xcursor_manager;
+  optional<idle_policy> m_idle;
 
 private:
-  template <typename Data> using listener = detail::listener_base<server, Data>;
+  template <auto Handler> using listener = detail::listener<Handler>;
+
+  listener<[](auto *self, wlr_output *output) {
+    self->m_outputs.emplace_back(*self, output);
+    // clients started before the first output get resized now
+    for (auto &t : self->m_toplevels)
+      t.fit_to_output();
+  }> m_listener_new_output;
+
+  // moved, resized or reconfigured outputs
+  listener<[](auto *self, void *) {
+    for (auto &t : self->m_toplevels)
+      t.fit_to_output();
+    self->update_output_configuration();
+    // a removed output leaves its clients without a primary output
+    self->schedule_hidden_frames();
+  }> m_listener_layout_change;
+
+  listener<[](auto *self, wlr_output_configuration_v1 *config) {
+    self->m_pending_output_configs.emplace_back(config);
+    self->apply_pending_output_configurations();
+  }> m_listener_output_manager_apply;
+
+  // nothing reaches wlr_cursor, so a test does not wait for themes
+  listener<[](auto *self, wlr_output_configuration_v1 *config) {
+    self->reply_output_configuration(config, true);
+  }> m_listener_output_manager_test;
+
+  listener<[](auto *self, wlr_xcursor_manager *manager) {
+    self->m_cursor.set_xcursor_manager(manager);
+    for (auto &o : self->m_outputs)
+      o.cursor_theme_loaded();
+    self->apply_pending_output_configurations();
+  }> m_listener_cursor_themes_ready;
+
+  listener<[](auto *self, wlr_input_device *device) {
+    switch (device->type) {
+    case WLR_INPUT_DEVICE_POINTER: {
+      wlr_log(WLR_DEBUG, "New pointer device: %s", device->name);
+      self->m_cursor.attach_input_device(device);
+      self->m_seat.add_capabilities(WL_SEAT_CAPABILITY_POINTER);
+      break;
+    }
+    case WLR_INPUT_DEVICE_KEYBOARD: {
+      wlr_log(WLR_DEBUG, "New keyboard device: %s", device->name);
+      auto *kbd = self->m_keyboards.create(
+          self->m_keyboards, wlr_keyboard_from_input_device(device),
+          *self->m_idle);
+      kbd->use_keymap(*self->m_keymaps,
+                      keymap_cache::rule_names::from_env());
+      wlr_keyboard_set_repeat_info(kbd->get(), 25, 600);
+      self->m_seat.set_keyboard(kbd->get());
+      self->m_seat.add_capabilities(WL_SEAT_CAPABILITY_KEYBOARD);
+      break;
+    }
+    default:
+      break;
+    }
+  }> m_listener_new_input;
+
+  listener<[](auto *self, wlr_seat_pointer_request_set_cursor_event *event) {
+    auto *client = self->m_seat.get()->pointer_state.focused_client;
+    wlr_log(WLR_DEBUG, "request cursor %p", client);
+    if (client == event->seat_client)
+      self->m_cursor.set_surface(event->surface, event->hotspot_x,
+                                 event->hotspot_y);
+  }> m_listener_request_cursor;
+
+  listener<[](auto *self, void *) {
+    if (self->m_motion.events != 0)
+      self->m_motion.frame = true;
+    else
+      self->m_seat.pointer_notify_frame();
+  }> m_listener_cursor_frame;
+
+  listener<[](auto *self, wlr_pointer_motion_event *event) {
+    auto &m = self->m_motion;
+    // deltas from different devices are accelerated differently
+    if (m.device != &event->pointer->base)
+      self->flush_cursor_motion();
+    m.device = &event->pointer->base;
+    m.time_msec = event->time_msec;
+    m.dx += event->delta_x;
+    m.dy += event->delta_y;
+    m.unaccel_dx += event->unaccel_dx;
+    m.unaccel_dy += event->unaccel_dy;
+    ++m.events;
+    ++self->m_motion_received;
+    self->queue_cursor_motion();
+  }> m_listener_cursor_motion;
+
+  listener<[](auto *self, wlr_xdg_toplevel *xdg_toplevel) {
+    wlr_log(WLR_DEBUG, "New xdg toplevel: %s", xdg_toplevel->title);
+    auto &t = self->m_toplevels.emplace_back(*self, xdg_toplevel);
+    if (!self->is_spare(t.pid()))
+      self->focus(t);
+  }> m_listener_new_xdg_toplevel;
+
+  listener<[](auto *self, bool *idle) {
+    for (auto &o : self->m_outputs)
+      if (o.enabled_by_user())
+        o.set_power(!*idle);
+    if (!*idle)
+      self->schedule_hidden_frames();
+  }> m_listener_idle_changed;
+};
 
-  listener<wlr_output> m_listener_new_output{
-      this, [](server *self, wlr_output *output) {
-        wlr_output_init_render(output, self->m_allocator.get(),
-                               self->m_renderer.get());
-        {
-          wlr_output_state output_state{};
-          wlr_output_state_init(&output_state);
-          wlr_output_state_set_enabled(&output_state, true);
-          wlr_output_mode *mode = wlr_output_preferred_mode(output);
-          if (mode != nullptr)
-            wlr_output_state_set_mode(&output_state, mode);
-          wlr_output_commit_state(output, &output_state);
-          wlr_output_state_finish(&output_state);
-        }
+output::output(server &server, wlr_output *output)
+    : m_server(&server), m_output(output) {
+  // must run before the layout's own destroy handler tears the scene output
+  detail::connect<&output::m_listener_destroy>(this, m_output->events.destroy);
 
-        self->m_last_output = output;
-        self->m_listener_output_frame.add_to_signal(output->events.frame);
-
-        auto *l_output =
-            wlr_output_layout_add_auto(self->m_output_layout.get(), output);
-        auto *scene_output =
-            wlr_scene_output_create(self->m_scene.get(), output);
-        wlr_scene_output_layout_add_output(self->m_scene_output_layout,
-                                           l_output, scene_output);
-      }};
-
-  listener<wlr_input_device> m_listener_new_input{
-      this, [](server *self, wlr_input_device *device) {
-        switch (device->type) {
-        case WLR_INPUT_DEVICE_POINTER: {
-          wlr_log(WLR_DEBUG, "New pointer device: %s", device->name);
-          self->m_cursor.attach_input_device(device);
-          break;
-        }
-        case WLR_INPUT_DEVICE_KEYBOARD: {
-          wlr_log(WLR_DEBUG, "New keyboard device: %s", device->name);
-          auto *kbd = new keyboard(
-              wlr_keyboard_from_input_device(device)); // FIXME: ownership
-          {
-            auto *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
-            auto *keymap = xkb_keymap_new_from_names(
-                context, nullptr, XKB_KEYMAP_COMPILE_NO_FLAGS);
-            assert(kbd->set_keymap(keymap));
-            xkb_keymap_unref(keymap);
-            xkb_context_unref(context);
-          }
-          wlr_keyboard_set_repeat_info(kbd->get(), 25, 600);
-          self->m_seat.set_keyboard(kbd->get());
-          break;
-        }
-        default:
-          break;
-        }
-      }};
-
-  listener<wlr_seat_pointer_request_set_cursor_event> m_listener_request_cursor{
-      this, [](server *self, wlr_seat_pointer_request_set_cursor_event *event) {
-        auto *client = self->m_seat.get()->pointer_state.focused_client;
-        wlr_log(WLR_DEBUG, "request cursor %p", client);
-        if (client == event->seat_client)
-          self->m_cursor.set_surface(event->surface, event->hotspot_x,
-                                     event->hotspot_y);
-      }};
-
-  listener<void> m_listener_cursor_frame{
-      this, [](server *self, void *) { self->m_seat.pointer_notify_frame(); }};
-
-  listener<wlr_pointer_motion_event> m_listener_cursor_motion{
-      this, [](server *self, wlr_pointer_motion_event *event) {
-        auto &c = self->m_cursor;
-        c.move(event->delta_x, event->delta_y, &event->pointer->base);
-        c.set_xcursor(self->m_xcursor_manager.get(), "default");
-      }};
-
-  listener<wlr_xdg_surface> m_listener_new_xdg_toplevel{
-      this, [](server *self, wlr_xdg_surface *surface) {
-        switch (surface->role) {
-        case WLR_XDG_SURFACE_ROLE_TOPLEVEL: {
-          auto *toplevel = surface->toplevel;
-          wlr_log(WLR_DEBUG, "New xdg toplevel: %s", toplevel->title);
-          auto *scene_tree = wlr_scene_xdg_surface_create(
-              &self->m_scene.get()->tree, toplevel->base);
-          wlr_scene_node_raise_to_top(&scene_tree->node);
-
-          auto *kbd = wlr_seat_get_keyboard(self->m_seat.get());
-          if (kbd != nullptr)
-            wlr_seat_keyboard_notify_enter(self->m_seat.get(), surface->surface,
-                                           kbd->keycodes, kbd->num_keycodes,
-                                           &kbd->modifiers);
-          break;
-        }
-        default:
-          break;
-        }
-      }};
-
-  listener<void> m_listener_output_frame{
-      this, [](server *self, void *) {
-        auto *scene = self->m_scene.get();
-        auto *scene_output =
-            wlr_scene_get_scene_output(scene, self->m_last_output);
-        wlr_scene_output_commit(scene_output, nullptr);
-        timespec now{};
-        clock_gettime(CLOCK_MONOTONIC, &now);
-        wlr_scene_output_send_frame_done(scene_output, &now);
-      }};
-};
+  if (server.m_benchmark.has_value())
+    m_benchmark = &*server.m_benchmark;
+
+  wlr_output_init_render(m_output, server.m_allocator.get(),
+                         server.m_renderer.get());
+  {
+    wlr_output_state output_state{};
+    wlr_output_state_init(&output_state);
+    wlr_output_state_set_enabled(&output_state, true);
+    if (m_benchmark != nullptr)
+      wlr_output_state_set_custom_mode(&output_state, m_output->width,
+                                       m_output->height,
+                                       benchmark::refresh_mhz);
+    else if (!set_working_mode(output_state))
+      wlr_log(WLR_ERROR, "No mode of %s passes a test commit",
+              m_output->name);
+    if (server.m_options.adaptive_sync) {
+      wlr_output_state_set_adaptive_sync_enabled(&output_state, true);
+      if (!wlr_output_test_state(m_output, &output_state)) {
+        wlr_log(WLR_INFO, "%s does not support adaptive sync",
+                m_output->name);
+        wlr_output_state_set_adaptive_sync_enabled(&output_state, false);
+      }
+    }
+    if (!wlr_output_commit_state(m_output, &output_state))
+      wlr_log(WLR_ERROR, "Failed to enable %s", m_output->name);
+    wlr_output_state_finish(&output_state);
+  }
+  // plugged in while everything else is asleep
+  if (server.m_idle.has_value() && server.m_idle->idle())
+    set_power(false);
+
+  detail::connect<&output::m_listener_frame, &output::m_listener_present,
+                  &output::m_listener_request_state,
+                  &output::m_listener_commit>(
+      this, m_output->events.frame, m_output->events.present,
+      m_output->events.request_state, m_output->events.commit);
+  scale_changed();
+
+  // wlr_cursor loads the image for an output's scale as soon as the output
+  // joins the layout
+  m_waiting_for_cursor_theme = true;
+  cursor_theme_loaded();
+}
+
+void output::cursor_theme_loaded() {
+  if (!m_waiting_for_cursor_theme ||
+      !m_server->m_cursor_themes->loaded(m_output->scale))
+    return;
+  m_waiting_for_cursor_theme = false;
+  auto *layout = m_server->m_output_layout.get();
+  // output management may have placed or disabled it meanwhile
+  if (!m_enabled_by_user || wlr_output_layout_get(layout, m_output) != nullptr)
+    return;
+  add_to_layout(wlr_output_layout_add_auto(layout, m_output));
+
+  if (m_benchmark != nullptr) {
+    wlr_box box{};
+    wlr_output_layout_get_box(layout, m_output, &box);
+    const std::array<float, 4> color = {0.F, 0.F, 0.F, 1.F};
+    m_benchmark_rect = wlr_scene_rect_create(&m_server->m_scene.get()->tree,
+                                             box.width, box.height,
+                                             color.data());
+    wlr_scene_node_set_position(&m_benchmark_rect->node, box.x, box.y);
+  }
+}
+
+bool output::wants_tearing(wlr_scene_buffer *scanout) {
+  if (m_server->m_options.compare_tearing)
+    return m_frame % 2 != 0;
+  auto *scene_surface = wlr_scene_surface_try_from_buffer(scanout);
+  return scene_surface != nullptr &&
+         wlr_tearing_control_manager_v1_surface_hint_from_surface(
+             m_server->m_tearing_control_manager, scene_surface->surface) ==
+             WP_TEARING_CONTROL_V1_PRESENTATION_HINT_ASYNC;
+}
+
+void output::add_to_layout(wlr_output_layout_output *l_output) {
+  if (m_scene_output != nullptr || l_output == nullptr)
+    return;
+  m_scene_output = wlr_scene_output_create(m_server->m_scene.get(), m_output);
+  wlr_scene_output_layout_add_output(m_server->m_scene_output_layout,
+                                     l_output, m_scene_output);
+  detail::connect<&output::m_listener_scene_output_destroy>(
+      this, m_scene_output->events.destroy);
+}
+
+void output::scale_changed() {
+  m_server->m_cursor_themes->request(m_output->scale);
+}
+
+void output::destroy() { m_server->remove_output(this); }
+
+toplevel::toplevel(server &server, wlr_xdg_toplevel *toplevel)
+    : m_server(&server), m_toplevel(toplevel),
+      m_scene_tree(wlr_scene_xdg_surface_create(&server.m_scene.get()->tree,
+                                                toplevel->base)) {
+  wlr_scene_node_raise_to_top(&m_scene_tree->node);
+  wl_client_get_credentials(wl_resource_get_client(m_toplevel->resource),
+                            &m_pid, nullptr, nullptr);
+  m_pid = server.spawned_ancestor(m_pid);
+  // a spare stays connected but out of sight until it is promoted
+  set_visible(!server.is_spare(m_pid));
+  detail::connect<&toplevel::m_listener_commit,
+                  &toplevel::m_listener_request_fullscreen,
+                  &toplevel::m_listener_destroy>(
+      this, m_toplevel->base->surface->events.commit,
+      m_toplevel->events.request_fullscreen, m_toplevel->events.destroy);
+}
+
+void toplevel::fit_to_output() {
+  if (!m_initialized)
+    return;
+  wlr_box box{};
+  if (auto *o = m_server->primary_output())
+    wlr_output_layout_get_box(m_server->m_output_layout.get(), o->get(), &box);
+  wlr_scene_node_set_position(&m_scene_tree->node, box.x, box.y);
+  wlr_xdg_toplevel_set_fullscreen(m_toplevel, true);
+  // a zero size lets the client pick until an output shows up
+  wlr_xdg_toplevel_set_size(m_toplevel, box.width, box.height);
+}
+
+void toplevel::destroy() { m_server->remove_toplevel(this); }
 } // namespace mcage
 
-std::counting_semaphore<1> sem{0};
+namespace {
+void usage(const char *name) {
+  std::fprintf(stderr,
+               "Usage: %s [-rsEAMT] [-i seconds] [--] [command [args...]]\n"
+               "       %s -b outputs [-n frames] [-o dir [-e every]]\n"
+               "       %s -D expected.ppm actual.ppm\n"
+               "       %s -H cycles [command [args...]]\n"
+               "       %s -L\n"
+               "  -r          restart the client whenever it exits\n"
+               "  -s          keep a hidden spare client to take over (implies "
+               "-r)\n"
+               "  -E          spawn the client before creating the backend\n"
+               "  -i seconds  turn outputs off after this long without "
+               "input\n"
+               "  -A          enable adaptive sync where supported\n"
+               "  -M          match the refresh rate to the client's frame "
+               "rate\n"
+               "  -T          alternate vsynced and torn scanout to compare "
+               "latency\n"
+               "  -b outputs  benchmark the frame loop on headless outputs\n"
+               "  -n frames   frames per output to benchmark (default %u)\n"
+               "  -o dir      write benchmark frames to dir as PPM images\n"
+               "  -e every    write every nth frame instead of the last one\n"
+               "  -H cycles   add, resize and remove headless outputs in a "
+               "loop,\n"
+               "              checking that the client follows the primary "
+               "output\n"
+               "  -L          compare listener dispatch with a raw "
+               "wl_listener\n"
+               "  -D          compare two PPM images, failing if they differ\n"
+               "  command     kiosk client to run (default foot)\n",
+               name, name, name, name, name,
+               mcage::benchmark_options{}.frames);
+}
+
+// a whole number from min to max, so that a negative or oversized argument
+// is rejected rather than wrapped
+std::optional<unsigned int> parse_number(const char *arg, unsigned int min,
+                                         unsigned int max) {
+  char *end = nullptr;
+  errno = 0;
+  long long value = std::strtoll(arg, &end, 10);
+  if (end == arg || *end != '\0' || errno != 0 || value < min || value > max)
+    return {};
+  return static_cast<unsigned int>(value);
+}
+
+// Per-pixel colour distance in YIQ space, weighted the way pixelmatch does,
+// so that differences the eye barely notices stay under the threshold.
+double yiq_delta(const uint8_t *a, const uint8_t *b) {
+  auto y = [](const uint8_t *p) {
+    return p[0] * 0.29889531 + p[1] * 0.58662247 + p[2] * 0.11448223;
+  };
+  auto i = [](const uint8_t *p) {
+    return p[0] * 0.59597799 - p[1] * 0.27417610 - p[2] * 0.32180189;
+  };
+  auto q = [](const uint8_t *p) {
+    return p[0] * 0.21147017 - p[1] * 0.52261711 + p[2] * 0.31114694;
+  };
+  auto dy = y(a) - y(b);
+  auto di = i(a) - i(b);
+  auto dq = q(a) - q(b);
+  return 0.5053 * dy * dy + 0.299 * di * di + 0.1957 * dq * dq;
+}
+
+int perceptual_diff(const char *expected_path, const char *actual_path) {
+  // largest possible yiq_delta, between black and white
+  constexpr double max_delta = 35215.;
+  constexpr double threshold = 0.1;
+  auto expected = mcage::image::read_ppm(expected_path);
+  auto actual = mcage::image::read_ppm(actual_path);
+  if (!expected.has_value() || !actual.has_value()) {
+    std::fprintf(stderr, "cannot read %s\n",
+                 expected.has_value() ? actual_path : expected_path);
+    return 2;
+  }
+  if (expected->width != actual->width || expected->height != actual->height) {
+    std::printf("size differs: %ux%u vs %ux%u\n", expected->width,
+                expected->height, actual->width, actual->height);
+    return 1;
+  }
+  size_t differing = 0;
+  double worst = 0.;
+  for (size_t px = 0; px < expected->rgb.size(); px += 3) {
+    auto delta = yiq_delta(&expected->rgb[px], &actual->rgb[px]);
+    worst = std::max(worst, delta);
+    if (delta > max_delta * threshold * threshold)
+      ++differing;
+  }
+  std::printf("%zu of %zu pixels differ, worst delta %.1f%%\n", differing,
+              expected->rgb.size() / 3, 100. * worst / max_delta);
+  return differing == 0 ? 0 : 1;
+}
+
+struct raw_counter {
+  uint64_t count = 0;
+  wl_listener listener{};
+};
 
-int main() {
-  wlr_log_init(WLR_DEBUG, nullptr);
-  mcage::server s{};
-  const char *socket = s.get_display().add_socket_auto();
+struct wrapped_counter {
+  uint64_t count = 0;
+  mcage::detail::listener<[](auto *self, void *) { ++self->count; }> listener;
+};
+
+// Times signal emission with a single listener attached, once written by hand
+// with offsetof and once with detail::listener, and fails if the wrapper is
+// noticeably slower. Each is timed several times and the fastest run kept,
+// so a preempted run does not count against either.
+int listener_benchmark() {
+  constexpr uint64_t iterations = 10'000'000;
+  constexpr int rounds = 5;
+  // relative and absolute, as a few ns are within timer noise
+  constexpr double tolerance = 0.25;
+  constexpr double slack_nsec = 0.5;
+  auto time_dispatch = [](wl_signal &signal) {
+    auto best = std::numeric_limits<double>::max();
+    for (int round = 0; round < rounds; ++round) {
+      for (uint64_t i = 0; i < iterations / 10; ++i)
+        wl_signal_emit(&signal, nullptr);
+      auto start = mcage::now_nsec(CLOCK_MONOTONIC);
+      for (uint64_t i = 0; i < iterations; ++i)
+        wl_signal_emit(&signal, nullptr);
+      best = std::min(
+          best, static_cast<double>(mcage::now_nsec(CLOCK_MONOTONIC) - start) /
+                    static_cast<double>(iterations));
+    }
+    return best;
+  };
+
+  raw_counter raw;
+  wl_signal raw_signal{};
+  wl_signal_init(&raw_signal);
+  raw.listener.notify = [](wl_listener *listener, void *) {
+    // NOLINTBEGIN
+    auto *counter = reinterpret_cast<raw_counter *>(
+        reinterpret_cast<char *>(listener) - offsetof(raw_counter, listener));
+    // NOLINTEND
+    ++counter->count;
+  };
+  wl_signal_add(&raw_signal, &raw.listener);
+  auto raw_nsec = time_dispatch(raw_signal);
+  wl_list_remove(&raw.listener.link);
+
+  wrapped_counter wrapped;
+  wl_signal wrapped_signal{};
+  wl_signal_init(&wrapped_signal);
+  mcage::detail::connect<&wrapped_counter::listener>(&wrapped, wrapped_signal);
+  auto wrapped_nsec = time_dispatch(wrapped_signal);
+
+  std::printf("listener dispatch over %" PRIu64 " emits\n", iterations);
+  std::printf("  raw wl_listener:  %.2f ns\n", raw_nsec);
+  std::printf("  detail::listener: %.2f ns\n", wrapped_nsec);
+  if (raw.count != wrapped.count) {
+    std::printf("  FAIL: %" PRIu64 " raw and %" PRIu64 " wrapped calls\n",
+                raw.count, wrapped.count);
+    return 1;
+  }
+  if (wrapped_nsec > raw_nsec * (1. + tolerance) + slack_nsec) {
+    std::printf("  FAIL: more than %.0f%% slower\n", tolerance * 100.);
+    return 1;
+  }
+  return 0;
+}
+
+// Adds, resizes and removes headless outputs in a loop under a client; fails
+// if an output outlives its wlr_output or stays in the layout, or if the
+// layout and the client do not follow the remaining output.
+int hotplug_stress(mcage::server &s, unsigned int cycles,
+                   std::vector<std::string> command) {
+  auto *loop = s.get_display().get_event_loop();
+  // long enough for a frame from the headless 60 Hz timer
+  auto run_for_a_frame = [&s, loop] {
+    for (int i = 0; i < 3; ++i) {
+      s.get_display().flush_clients();
+      wl_event_loop_dispatch(loop, 10);
+    }
+  };
+  auto fail = [&s](unsigned int cycle, const char *what) {
+    std::fprintf(stderr, "hotplug: cycle %u: %s\n", cycle, what);
+    s.stop_client();
+    return 1;
+  };
+  s.start_backend();
+  setenv("WAYLAND_DISPLAY", s.add_socket(), 1);
+  if (!s.start_client(std::move(command), {}))
+    return 1;
+  // up to five seconds for the client to map its toplevel
+  for (int i = 0; i < 100 && s.toplevel_count() == 0; ++i) {
+    s.get_display().flush_clients();
+    wl_event_loop_dispatch(loop, 50);
+  }
+  if (s.toplevel_count() == 0)
+    return fail(0, "the client never mapped a toplevel");
+
+  for (unsigned int i = 0; i < cycles; ++i) {
+    auto *first = s.get_backend().add_headless_output(1920, 1080);
+    auto *second = s.get_backend().add_headless_output(1280, 720);
+    run_for_a_frame();
+    if (!s.toplevels_fit_primary_output())
+      return fail(i, "the client does not fit the first output");
+    // a resize arrives like any other mode change
+    wlr_output_state state{};
+    wlr_output_state_init(&state);
+    wlr_output_state_set_custom_mode(&state, 800, 600, 0);
+    wlr_output_commit_state(second, &state);
+    wlr_output_state_finish(&state);
+    run_for_a_frame();
+    // the second output becomes the primary one and moves to the origin
+    wlr_output_destroy(first);
+    run_for_a_frame();
+    auto *primary = s.primary_output();
+    if (primary == nullptr || primary->get() != second)
+      return fail(i, "the second output did not become primary");
+    wlr_box box{};
+    wlr_output_layout_get_box(s.get_output_layout().get(), second, &box);
+    if (box.x != 0 || box.y != 0)
+      return fail(i, "the second output was not moved to the origin");
+    if (!s.toplevels_fit_primary_output())
+      return fail(i, "the client was not refitted to the second output");
+    wlr_output_destroy(second);
+    run_for_a_frame();
+    if (s.output_count() != 0 ||
+        wl_list_empty(&s.get_output_layout().get()->outputs) == 0)
+      return fail(i, "outputs were left behind");
+  }
+  s.stop_client();
+  std::printf("hotplug: %u cycles, no outputs left behind\n", cycles);
+  return 0;
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::optional<mcage::benchmark_options> benchmark;
+  mcage::supervisor_options supervise;
+  bool diff = false;
+  bool early_client = false;
+  mcage::server_options options;
+  unsigned int hotplug_cycles = 0;
+  // '+' stops at the command so that its own options are left alone
+  for (int opt{};
+       (opt = ::getopt(argc, argv, "+rsEAMTi:b:n:o:e:H:LDh")) != -1;) {
+    switch (opt) {
+    case 's':
+      supervise.spare = true;
+      [[fallthrough]];
+    case 'r':
+      supervise.restart = true;
+      break;
+    case 'E':
+      early_client = true;
+      break;
+    case 'A':
+      options.adaptive_sync = true;
+      break;
+    case 'M':
+      options.match_refresh = true;
+      break;
+    case 'T':
+      options.compare_tearing = true;
+      break;
+    case 'H': {
+      auto cycles =
+          parse_number(optarg, 1, std::numeric_limits<unsigned int>::max());
+      if (!cycles.has_value()) {
+        usage(argv[0]);
+        return 1;
+      }
+      hotplug_cycles = *cycles;
+      options.headless = true;
+      break;
+    }
+    case 'i': {
+      auto timeout =
+          parse_number(optarg, 0, mcage::idle_policy::max_timeout_sec);
+      if (!timeout.has_value()) {
+        usage(argv[0]);
+        return 1;
+      }
+      options.idle_timeout_sec = *timeout;
+      break;
+    }
+    case 'L':
+      return listener_benchmark();
+    case 'D':
+      diff = true;
+      break;
+    case 'b': {
+      auto outputs = parse_number(optarg, 1, mcage::benchmark::max_outputs);
+      if (!outputs.has_value()) {
+        usage(argv[0]);
+        return 1;
+      }
+      if (!benchmark.has_value())
+        benchmark.emplace();
+      benchmark->outputs = *outputs;
+      break;
+    }
+    case 'n': {
+      auto frames = parse_number(optarg, 1, mcage::benchmark::max_frames);
+      if (!frames.has_value()) {
+        usage(argv[0]);
+        return 1;
+      }
+      if (!benchmark.has_value())
+        benchmark.emplace();
+      benchmark->frames = *frames;
+      break;
+    }
+    case 'o':
+      if (!benchmark.has_value())
+        benchmark.emplace();
+      benchmark->dump_dir = optarg;
+      break;
+    case 'e': {
+      auto every =
+          parse_number(optarg, 0, std::numeric_limits<unsigned int>::max());
+      if (!every.has_value()) {
+        usage(argv[0]);
+        return 1;
+      }
+      if (!benchmark.has_value())
+        benchmark.emplace();
+      benchmark->dump_every = *every;
+      break;
+    }
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (diff) {
+    if (argc - optind != 2) {
+      usage(argv[0]);
+      return 1;
+    }
+    return perceptual_diff(argv[optind], argv[optind + 1]);
+  }
+  // frames are read back by the CPU, and pixman renders the same pixels on
+  // any machine, GPU or not
+  if (benchmark.has_value() && benchmark->dump_dir != nullptr)
+    setenv("WLR_RENDERER", "pixman", 0);
+
+  wlr_log_init(benchmark.has_value() ? WLR_ERROR : WLR_DEBUG, nullptr);
+  mcage::server s{benchmark, options};
+
+  std::vector<std::string> command(argv + optind, argv + argc);
+  if (command.empty())
+    command.emplace_back("foot");
+
+  if (hotplug_cycles != 0) {
+    s.create_backend();
+    return hotplug_stress(s, hotplug_cycles, std::move(command));
+  }
+
+  if (benchmark.has_value()) {
+    s.create_backend();
+    s.start_backend();
+    for (unsigned int i = 0; i < benchmark->outputs; ++i)
+      s.get_backend().add_headless_output(mcage::benchmark::output_width,
+                                          mcage::benchmark::output_height);
+    s.get_display().run();
+    return s.get_benchmark()->report() ? 0 : 1;
+  }
+
+  if (!early_client)
+    s.create_backend();
+  const char *socket = s.add_socket();
   wlr_log(WLR_INFO, "Running compositor on wayland display '%s'", socket);
-  s.get_backend().start();
+  if (!early_client)
+    s.start_backend();
 
   setenv("WAYLAND_DISPLAY", socket, 1);
 
-  pid_t child_pid{};
-  {
-    ::posix_spawn_file_actions_t fa{};
-    ::posix_spawn_file_actions_init(&fa);
-    std::string file = "foot";
-    const std::array<char *, 2> argv = {file.data(), nullptr};
-    ::posix_spawnp(&child_pid, file.c_str(), nullptr, nullptr, argv.data(),
-                   environ);
-    std::printf("Spawned %d\n", child_pid);
-  }
-
-  // run in another thread to prevent deadlock between client and compositor
-  std::jthread sig_thread([&, child_pid]() {
-    sem.acquire();
-    std::printf("Killing child %d\n", child_pid);
-    ::kill(child_pid, SIGTERM);
-    ::waitpid(child_pid, nullptr, 0);
-    std::printf("Terminating display\n");
-    s.get_display().terminate();
-  });
-
-  {
-    struct sigaction action {};
-    action.sa_handler = [](int) { sem.release(); };
-    sigemptyset(&action.sa_mask);
-    sigaction(SIGINT, &action, nullptr);
+  if (!s.start_client(std::move(command), supervise))
+    return 1;
+  // the client loads and connects while the backend, renderer and globals
+  // are created and the outputs brought up; its requests wait in the socket
+  // until the loop runs
+  if (early_client) {
+    s.create_backend();
+    s.start_backend();
   }
 
   s.get_display().run();
+  return s.exit_code();
 }